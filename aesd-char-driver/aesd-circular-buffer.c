@@ -8,6 +8,7 @@
  *
  */
 
+#ifdef __KERNEL__
 #include <linux/string.h>
 #include <linux/module.h>
 #include <linux/init.h>
@@ -16,8 +17,78 @@
 #include <linux/cdev.h>
 #include <linux/fs.h>
 #include <linux/slab.h>
+#else
+#include <string.h>
+#endif
 
 #include "aesd-circular-buffer.h"
+#ifdef __KERNEL__
+#include "aesdchar_trace.h"
+#else
+#define trace_aesd_buffer_add_entry(...) do { } while (0)
+#define trace_aesd_buffer_add_entries(...) do { } while (0)
+#endif
+
+/**
+ * @return the index of the last live entry starting at or before @param char_offset, which
+ * must be below total_size.
+ */
+static inline unsigned int aesd_circular_buffer_search_starts(const struct aesd_circular_buffer *buffer,
+            uint64_t char_offset)
+{
+    unsigned int low = 0;
+    unsigned int high = aesd_circular_buffer_count(buffer);
+
+    // entry low always starts at or before char_offset, entry high never does
+    while (high - low > 1) {
+        unsigned int mid = low + (high - low) / 2;
+        if (aesd_circular_buffer_offset_of(buffer, mid) <= char_offset) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/*
+ * Small rings built for userspace on targets with native 64 bit vector compares are searched by
+ * counting the slots that start at or before the target, which needs no branches.  The kernel
+ * cannot use vector registers here, and past a few dozen slots, or when the compares would be
+ * emulated, the binary search above is faster.
+ */
+#if !defined(__KERNEL__) && defined(__GNUC__) && (defined(__AVX2__) || defined(__aarch64__)) && \
+        AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED <= 64
+#define AESD_CIRCULAR_BUFFER_VECTOR_SCAN
+
+typedef uint64_t aesd_u64x4 __attribute__((vector_size(32)));
+typedef int64_t aesd_s64x4 __attribute__((vector_size(32)));
+
+/**
+ * @return the number of live entries starting at or before @param char_offset.  Branch free,
+ * it compares every slot, relying on empty slots holding AESD_CIRCULAR_BUFFER_NO_START.
+ */
+static unsigned int aesd_circular_buffer_count_starts(const struct aesd_circular_buffer *buffer,
+            uint64_t char_offset)
+{
+    const uint64_t base = buffer->base_offset;
+    aesd_s64x4 hits = { 0 };
+    unsigned int count = 0;
+    unsigned int i;
+
+    for (i = 0; i + 4 <= AESD_CIRCULAR_BUFFER_STORAGE; i += 4) {
+        aesd_u64x4 start;
+        memcpy(&start, &buffer->start[i], sizeof(start));
+        // each lane of the comparison is -1 when true
+        hits -= (start - base) <= char_offset;
+    }
+    count = hits[0] + hits[1] + hits[2] + hits[3];
+    for (; i < AESD_CIRCULAR_BUFFER_STORAGE; i++) {
+        count += buffer->start[i] - base <= char_offset;
+    }
+    return count;
+}
+#endif
 
 /**
  * @param buffer the buffer to search for corresponding offset.  Any necessary locking must be performed by caller.
@@ -32,79 +103,184 @@
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn )
 {
-    uint8_t index;
-    struct aesd_buffer_entry *entry;
-    uint8_t total_bytes = 0;
-    AESD_CIRCULAR_BUFFER_FOREACH(entry,buffer,index) {
-        total_bytes += entry->size;
-    }
-    index = buffer->out_offs;
-    entry = &(buffer->entry[index]);
+    unsigned int index;
 
-    if( char_offset >= total_bytes ) {
+    if( char_offset >= (size_t)buffer->total_size ) {
         return NULL;
     }
-    if (char_offset == 0) {
-        *entry_offset_byte_rtn = 0;
-        entry = &(buffer->entry[index]);
-        return entry;
-    }
-    while( char_offset >= entry->size ) {
-        char_offset -= entry->size;
-        index = (index + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-        entry = &(buffer->entry[index]);
-    }
-    if (char_offset == entry->size) {
-        *entry_offset_byte_rtn = 0;
+#ifdef AESD_CIRCULAR_BUFFER_VECTOR_SCAN
+    index = aesd_circular_buffer_count_starts(buffer, char_offset) - 1;
+#else
+    index = aesd_circular_buffer_search_starts(buffer, char_offset);
+#endif
+    *entry_offset_byte_rtn = char_offset - aesd_circular_buffer_offset_of(buffer, index);
+    return aesd_circular_buffer_at(buffer, index);
+}
+
+#ifndef __KERNEL__
+/**
+ * Userspace only, so tests can check that both offset searches agree: stores in @param index
+ * the live entry holding @param char_offset, which must be below total_size, as found by the
+ * vector scan when @param vector_scan is set and by the binary search otherwise.
+ * @return false if the vector scan was asked for but is not built for this target
+ */
+bool aesd_circular_buffer_search_index(const struct aesd_circular_buffer *buffer,
+            uint64_t char_offset, bool vector_scan, unsigned int *index)
+{
+    if (vector_scan) {
+#ifdef AESD_CIRCULAR_BUFFER_VECTOR_SCAN
+        *index = aesd_circular_buffer_count_starts(buffer, char_offset) - 1;
+        return true;
+#else
+        return false;
+#endif
     }
-    else {
-        *entry_offset_byte_rtn = char_offset;
+    *index = aesd_circular_buffer_search_starts(buffer, char_offset);
+    return true;
+}
+#endif
+
+/**
+ * Positions @param iter at @param char_offset of @param buffer, limited to @param count bytes.
+ * @return false if char_offset is past the end of the data, in which case
+ *      aesd_circular_buffer_iter_next() returns nothing.
+ */
+bool aesd_circular_buffer_iter_init(struct aesd_circular_buffer_iter *iter,
+            struct aesd_circular_buffer *buffer, size_t char_offset, size_t count)
+{
+    struct aesd_buffer_entry *entry;
+
+    iter->buffer = buffer;
+    iter->remaining = count;
+    iter->offset = 0;
+    entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, char_offset, &iter->offset);
+    if (entry == NULL) {
+        iter->index = aesd_circular_buffer_count(buffer);
+        return false;
     }
-    return entry;
+    iter->index = aesd_circular_buffer_index_of(buffer, entry);
+    return true;
+}
+
+/**
+ * Stores the next segment of the range in @param data and @param len.  Empty entries are
+ * skipped, so len is never 0.
+ * @return false once the range or the data is exhausted
+ */
+bool aesd_circular_buffer_iter_next(struct aesd_circular_buffer_iter *iter,
+            const char **data, size_t *len)
+{
+    unsigned int count = aesd_circular_buffer_count(iter->buffer);
+    struct aesd_buffer_entry *entry;
 
+    struct aesd_buffer_chain *chain;
+    size_t within;
+
+    while (iter->remaining > 0 && iter->index < count) {
+        entry = aesd_circular_buffer_at(iter->buffer, iter->index);
+        if (iter->offset >= entry->size) {
+            iter->index++;
+            iter->offset = 0;
+            continue;
+        }
+        chain = aesd_buffer_entry_chain(entry->buffptr);
+        if (chain) {
+            // stop at the end of the segment holding offset
+            within = iter->offset % chain->segment_size;
+            *data = chain->segment[iter->offset / chain->segment_size] + within;
+            *len = chain->segment_size - within;
+            if (*len > entry->size - iter->offset) {
+                *len = entry->size - iter->offset;
+            }
+        } else {
+            *data = entry->buffptr + iter->offset;
+            *len = entry->size - iter->offset;
+        }
+        if (*len > iter->remaining) {
+            *len = iter->remaining;
+        }
+        iter->remaining -= *len;
+        iter->offset += *len;
+        return true;
+    }
+    return false;
 }
 
 /**
-* Adds entry @param add_entry to @param buffer in the location specified in buffer->in_offs.
-* If the buffer was already full, overwrites the oldest entry and advances buffer->out_offs to the
-* new start location.
+* Adds entry @param add_entry to @param buffer after the newest entry.
+* If the buffer was already full, drops the oldest entry.
 * Any necessary locking must be handled by the caller
 * Any memory referenced in @param add_entry must be allocated by and/or must have a lifetime managed by the caller.
+* @return the buffptr of the entry which was overwritten, so the caller can release it, or NULL if
+* no entry was overwritten.
 */
-void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
+const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
 {
-    if(buffer->full) {
-	// buffer is full - add to buffer at in_offs, advance both out_offs and in_offs
-	// subtract size we are removing
-	buffer->total_size -= buffer->entry[buffer->in_offs].size;
-	// add new size
-	buffer->total_size += add_entry->size;
-	buffer->entry[buffer->in_offs] = *add_entry;
-	if(buffer->in_offs + 1 == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
-	    // reached the end of the buffer again, start at the beginning
-	    buffer->in_offs = 0;
-	} else {
-            buffer->in_offs++;
-        }
-        if(buffer->out_offs + 1 == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
-            // reached the end of the buffer again, start at the beginning
-            buffer->out_offs = 0;
-        } else {
-	    buffer->out_offs++;
-	}
+    struct aesd_buffer_entry evicted = { 0 };
+    uint64_t start = buffer->base_offset + buffer->total_size;
+    bool full = aesd_circular_buffer_push(buffer, add_entry, &evicted);
+
+    if (full) {
+        buffer->start[(AESD_CIRCULAR_BUFFER_INDEX_TYPE)(buffer->tail - 1) & (AESD_CIRCULAR_BUFFER_STORAGE - 1)] =
+                AESD_CIRCULAR_BUFFER_NO_START;
+        buffer->base_offset += evicted.size;
     }
-    else {
-	// buffer is not full - add to buffer, increment in_offs
-	buffer->total_size += add_entry->size;
-	buffer->entry[buffer->in_offs] = *add_entry;
-        if(buffer->in_offs + 1 == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
-            // the buffer is now full
-	    buffer->in_offs = 0;
-	    buffer->full = true;
-	} else {
-	    buffer->in_offs++;
-	}
+    buffer->start[(AESD_CIRCULAR_BUFFER_INDEX_TYPE)(buffer->head - 1) & (AESD_CIRCULAR_BUFFER_STORAGE - 1)] = start;
+    buffer->total_size -= evicted.size;
+    buffer->total_size += add_entry->size;
+    trace_aesd_buffer_add_entry(buffer, add_entry->size, evicted.size, full, buffer->total_size);
+    return evicted.buffptr;
+}
+
+/**
+* Adds the @param count entries of @param add_entries to @param buffer in order, as if by
+* aesd_circular_buffer_add_entry, but updating the counters and total_size once.
+* Any necessary locking must be handled by the caller
+* @param evicted receives the buffptr of every entry dropped, oldest first, so the caller can
+*      release them together.  It needs room for count entries.  When the batch is larger than
+*      the capacity its own first entries are dropped and returned here too.
+* @return the number of pointers stored in evicted
+*/
+size_t aesd_circular_buffer_add_entries(struct aesd_circular_buffer *buffer,
+            const struct aesd_buffer_entry *add_entries, size_t count, const char **evicted)
+{
+    const unsigned int mask = AESD_CIRCULAR_BUFFER_STORAGE - 1;
+    size_t live = aesd_circular_buffer_count(buffer);
+    size_t overflow = live + count > AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED ?
+            live + count - AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED : 0;
+    // the oldest entries go first, then the start of the batch itself
+    size_t evict_live = overflow < live ? overflow : live;
+    size_t skip = overflow - evict_live;
+    uint64_t base = buffer->base_offset;
+    uint64_t end = base + buffer->total_size;
+    size_t nevicted = 0;
+    size_t i;
+
+    for (i = 0; i < evict_live; i++) {
+        unsigned int slot = (buffer->tail + i) & mask;
+        evicted[nevicted++] = buffer->entry[slot].buffptr;
+        base += buffer->entry[slot].size;
+        buffer->entry[slot] = (struct aesd_buffer_entry){ 0 };
+        buffer->start[slot] = AESD_CIRCULAR_BUFFER_NO_START;
     }
+    for (i = 0; i < skip; i++) {
+        evicted[nevicted++] = add_entries[i].buffptr;
+        base += add_entries[i].size;
+        end += add_entries[i].size;
+    }
+    for (; i < count; i++) {
+        unsigned int slot = (buffer->head + i) & mask;
+        buffer->entry[slot] = add_entries[i];
+        buffer->start[slot] = end;
+        end += add_entries[i].size;
+    }
+    // dropped batch entries still advance both counters, exactly as repeated single adds would
+    buffer->tail += evict_live + skip;
+    buffer->head += count;
+    buffer->base_offset = base;
+    buffer->total_size = end - base;
+    trace_aesd_buffer_add_entries(buffer, count, nevicted, buffer->total_size);
+    return nevicted;
 }
 
 /**
@@ -112,7 +288,12 @@ void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const s
 */
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
+    unsigned int i;
+
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    for (i = 0; i < AESD_CIRCULAR_BUFFER_STORAGE; i++) {
+        buffer->start[i] = AESD_CIRCULAR_BUFFER_NO_START;
+    }
 }
 
 extern size_t aesd_circular_buffer_read_helper(struct aesd_circular_buffer *buffer,
@@ -124,7 +305,6 @@ extern size_t aesd_circular_buffer_read_helper(struct aesd_circular_buffer *buff
     uint k = *byte_offset;
     uint end = 0;
     size_t read_count = 0;
-    char* tmp = kmalloc(count, GFP_KERNEL);
     for(i = index1; i < index2; i++) {
         if(buffer->entry[i].size == 0 || (count - read_count) == 0) {
             // there is no more data, break loop
@@ -136,8 +316,7 @@ extern size_t aesd_circular_buffer_read_helper(struct aesd_circular_buffer *buff
 	} else {
 	    end = count - read_count + *byte_offset;
 	}
-        for(k; k < end; k++) {
-	    tmp[j] = buffer->entry[i].buffptr[k];
+        for(; k < end; k++) {
             data[read_count + j] = buffer->entry[i].buffptr[k];
 	    j++;
         }
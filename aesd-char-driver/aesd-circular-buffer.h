@@ -14,9 +14,34 @@
 #include <stddef.h> // size_t
 #include <stdint.h> // uintx_t
 #include <stdbool.h>
+#include <sys/types.h> // ssize_t
 #endif
 
+#include "aesd-ring.h"
+
+/**
+ * May be overridden at build time for userspace builds, for instance by the benchmarks in
+ * ../benchmarks which sweep several capacities.  The head and tail counters are
+ * AESD_CIRCULAR_BUFFER_INDEX_TYPE, which must be able to hold the capacity.
+ */
+#ifndef AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+#endif
+#ifndef AESD_CIRCULAR_BUFFER_INDEX_TYPE
+#define AESD_CIRCULAR_BUFFER_INDEX_TYPE uint8_t
+#endif
+
+/**
+ * Number of slots in aesd_circular_buffer.entry, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+ * rounded up to a power of two
+ */
+#define AESD_CIRCULAR_BUFFER_STORAGE AESD_RING_STORAGE(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+
+/**
+ * Value of aesd_circular_buffer.start for a slot without a live entry.  Any live start minus
+ * base_offset is smaller, which lets offset scans cover every slot without checking liveness.
+ */
+#define AESD_CIRCULAR_BUFFER_NO_START UINT64_MAX
 
 struct aesd_buffer_entry
 {
@@ -30,36 +55,146 @@ struct aesd_buffer_entry
     size_t size;
 };
 
+/**
+ * Storage for an entry too large for one contiguous buffer, split into equal segments.  Every
+ * segment but the last is full.  The entry's buffptr holds aesd_buffer_chain_ptr() of the chain
+ * rather than the data, and is recognised by aesd_buffer_entry_chain().
+ *
+ * Chains are tagged in the low bit of buffptr, which only works when contiguous buffers are at
+ * least 2 byte aligned.  The kernel driver guarantees that for its payloads; userspace builds
+ * must opt in by defining AESD_BUFFER_CHAINS, since arbitrary strings may be added there.
+ */
+struct aesd_buffer_chain
+{
+    size_t segment_size;
+    size_t nr_segments;
+    char *segment[];
+};
+
+#if defined(__KERNEL__) || defined(AESD_BUFFER_CHAINS)
+#define AESD_BUFFER_CHAIN_TAG ((uintptr_t)1)
+
+static inline const char *aesd_buffer_chain_ptr(const struct aesd_buffer_chain *chain)
+{
+    return (const char *)((uintptr_t)chain | AESD_BUFFER_CHAIN_TAG);
+}
+
+/**
+ * @return the chain @param buffptr refers to, or NULL if it is a contiguous buffer
+ */
+static inline struct aesd_buffer_chain *aesd_buffer_entry_chain(const char *buffptr)
+{
+    if (!((uintptr_t)buffptr & AESD_BUFFER_CHAIN_TAG)) {
+        return NULL;
+    }
+    return (struct aesd_buffer_chain *)((uintptr_t)buffptr & ~AESD_BUFFER_CHAIN_TAG);
+}
+#else
+static inline struct aesd_buffer_chain *aesd_buffer_entry_chain(const char *buffptr)
+{
+    (void)buffptr;
+    return NULL;
+}
+#endif
+
 struct aesd_circular_buffer
 {
     /**
-     * An array of pointers to memory allocated for the most recent write operations
+     * entry[] holds the most recent write operations.  head and tail count the entries ever
+     * added and evicted, see aesd-ring.h; use aesd_circular_buffer_at() to walk them oldest first.
      */
-    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    AESD_RING_FIELDS(struct aesd_buffer_entry, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED,
+            AESD_CIRCULAR_BUFFER_INDEX_TYPE);
     /**
-     * The current location in the entry structure where the next write should
-     * be stored.
+     * The stream offset where the entry in the same entry[] slot starts, counting every byte
+     * ever added, or AESD_CIRCULAR_BUFFER_NO_START.  Kept apart from entry[] so offset
+     * searches read only this array.
      */
-    uint8_t in_offs;
+    uint64_t start[AESD_CIRCULAR_BUFFER_STORAGE];
     /**
-     * The first location in the entry structure to read from
+     * The stream offset of the oldest entry, which is the number of bytes evicted so far
      */
-    uint8_t out_offs;
-    /**
-     * set to true when the buffer entry structure is full
-     */
-    bool full;
+    uint64_t base_offset;
 
     ssize_t total_size;
 };
 
+/*
+ * aesd_circular_buffer_count(), _full(), _at(), _index_of(), _push() and _reset()
+ */
+AESD_RING_FUNCTIONS(aesd_circular_buffer, struct aesd_circular_buffer, struct aesd_buffer_entry,
+        AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, AESD_CIRCULAR_BUFFER_INDEX_TYPE)
+
+/**
+ * @return the zero referenced offset of the live entry @param index places after the oldest,
+ * as seen by a reader of the concatenated entries.
+ */
+static inline uint64_t aesd_circular_buffer_offset_of(const struct aesd_circular_buffer *buffer,
+        unsigned int index)
+{
+    return buffer->start[(buffer->tail + index) & (AESD_CIRCULAR_BUFFER_STORAGE - 1)] -
+            buffer->base_offset;
+}
+
+/**
+ * Walks the contents of a byte range as contiguous segments in read order, one per entry, or one
+ * per chain segment for chained entries.
+ * Set up with aesd_circular_buffer_iter_init() and advanced with aesd_circular_buffer_iter_next().
+ * The buffer must not change while an iterator is in use.
+ * Example usage, with @c copy standing for copy_to_user, copy_to_iter, memcpy and so on:
+ * struct aesd_circular_buffer_iter iter;
+ * const char *data;
+ * size_t len;
+ * aesd_circular_buffer_iter_init(&iter, &buffer, fpos, count);
+ * while (aesd_circular_buffer_iter_next(&iter, &data, &len)) {
+ *      copy(dest, data, len);
+ *      dest += len;
+ * }
+ */
+struct aesd_circular_buffer_iter
+{
+    struct aesd_circular_buffer *buffer;
+    /**
+     * The live entry holding the next segment, counted from the oldest
+     */
+    unsigned int index;
+    /**
+     * Where the next segment starts within that entry, which may be past the first
+     * segment of a chain
+     */
+    size_t offset;
+    /**
+     * Bytes of the range not yet returned
+     */
+    size_t remaining;
+};
+
+extern bool aesd_circular_buffer_iter_init(struct aesd_circular_buffer_iter *iter,
+            struct aesd_circular_buffer *buffer, size_t char_offset, size_t count);
+
+extern bool aesd_circular_buffer_iter_next(struct aesd_circular_buffer_iter *iter,
+            const char **data, size_t *len);
+
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn );
 
-void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
+#ifndef __KERNEL__
+extern bool aesd_circular_buffer_search_index(const struct aesd_circular_buffer *buffer,
+            uint64_t char_offset, bool vector_scan, unsigned int *index);
+#endif
+
+const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
+
+extern size_t aesd_circular_buffer_add_entries(struct aesd_circular_buffer *buffer,
+            const struct aesd_buffer_entry *add_entries, size_t count, const char **evicted);
 
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+/**
+ * Copies entries from storage slots index1 up to index2.  New code should use
+ * struct aesd_circular_buffer_iter, which follows the ring order, handles wraparound and
+ * walks chained entries; this helper only reads contiguous ones.
+ */
 extern size_t aesd_circular_buffer_read_helper(struct aesd_circular_buffer *buffer, size_t index1, size_t index2,
 	    char* data, size_t count, size_t *byte_offset);
 
@@ -68,7 +203,8 @@ extern size_t aesd_circular_buffer_read_helper(struct aesd_circular_buffer *buff
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a stack allocated value used by this macro for an index, wide enough to
+ *      count to AESD_CIRCULAR_BUFFER_STORAGE
  * Example usage:
  * uint8_t index;
  * struct aesd_circular_buffer buffer;
@@ -79,7 +215,7 @@ extern size_t aesd_circular_buffer_read_helper(struct aesd_circular_buffer *buff
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
     for(index=0, entryptr=&((buffer)->entry[index]); \
-            index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
+            index<AESD_CIRCULAR_BUFFER_STORAGE; \
             index++, entryptr=&((buffer)->entry[index]))
 
 
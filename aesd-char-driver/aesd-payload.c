@@ -0,0 +1,203 @@
+/**
+ * @file aesd-payload.c
+ * @brief Allocation of aesdchar entry payloads and descriptors
+ *
+ * Entry payloads are allocated as pages rather than kmalloc buffers so aesd_vm_fault can
+ * insert them into a userspace mapping.  Multi page payloads are compound pages, which lets
+ * a mapping hold a reference to any page of the payload after the driver has released it.
+ *
+ * Released payloads which are not mapped anywhere are kept on a free list for their page order
+ * and handed out again by the next allocation of the same size class.  A free payload stores
+ * the pointer to the next free payload of its class in its first bytes.
+ *
+ * Entries above AESD_CHAIN_THRESHOLD are made of order 0 payloads held by a chain descriptor,
+ * so their size is limited by free memory rather than by the largest contiguous free block.
+ *
+ * @author asabbagh4
+ * @date 2026-10-19
+ *
+ */
+
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/overflow.h>
+
+#include "aesd-circular-buffer.h"
+#include "aesd-payload.h"
+
+struct aesd_payload_pool
+{
+    spinlock_t lock;
+    void *free[AESD_PAYLOAD_POOL_ORDERS];
+    unsigned int nr_free[AESD_PAYLOAD_POOL_ORDERS];
+    struct aesd_payload_stats stats;
+};
+
+static struct aesd_payload_pool aesd_pool;
+static struct kmem_cache *aesd_fragment_cache;
+
+int aesd_payload_pool_init(void)
+{
+    memset(&aesd_pool, 0, sizeof(aesd_pool));
+    spin_lock_init(&aesd_pool.lock);
+    aesd_fragment_cache = KMEM_CACHE(aesd_fragment, SLAB_HWCACHE_ALIGN);
+    if (!aesd_fragment_cache) {
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+void aesd_payload_pool_destroy(void)
+{
+    unsigned int order;
+    void *payload;
+
+    for (order = 0; order < AESD_PAYLOAD_POOL_ORDERS; order++) {
+        while ((payload = aesd_pool.free[order]) != NULL) {
+            aesd_pool.free[order] = *(void **)payload;
+            put_page(virt_to_page(payload));
+        }
+        aesd_pool.nr_free[order] = 0;
+    }
+    kmem_cache_destroy(aesd_fragment_cache);
+}
+
+/**
+ * @return page backed storage for at least @param size bytes, or NULL if no memory is available
+ */
+char *aesd_payload_alloc(size_t size)
+{
+    unsigned int order = get_order(size);
+    struct page *page;
+    void *payload = NULL;
+
+    if (order < AESD_PAYLOAD_POOL_ORDERS) {
+        spin_lock(&aesd_pool.lock);
+        payload = aesd_pool.free[order];
+        if (payload) {
+            aesd_pool.free[order] = *(void **)payload;
+            aesd_pool.nr_free[order]--;
+            aesd_pool.stats.pool_hits++;
+        }
+        spin_unlock(&aesd_pool.lock);
+        if (payload) {
+            return payload;
+        }
+    }
+
+    page = alloc_pages(GFP_KERNEL | __GFP_COMP, order);
+    if (!page) {
+        return NULL;
+    }
+    spin_lock(&aesd_pool.lock);
+    aesd_pool.stats.page_allocs++;
+    spin_unlock(&aesd_pool.lock);
+    return page_address(page);
+}
+
+/**
+ * Releases @param payload returned by aesd_payload_alloc.  Payloads still referenced by a
+ * userspace mapping are released to the page allocator once the last mapping goes away.
+ */
+void aesd_payload_free(const char *payload)
+{
+    struct page *page;
+    unsigned int order;
+
+    if (!payload) {
+        return;
+    }
+    page = virt_to_page(payload);
+    order = compound_order(page);
+
+    spin_lock(&aesd_pool.lock);
+    if (order < AESD_PAYLOAD_POOL_ORDERS && page_ref_count(page) == 1 &&
+            aesd_pool.nr_free[order] < AESD_PAYLOAD_POOL_DEPTH) {
+        *(void **)payload = aesd_pool.free[order];
+        aesd_pool.free[order] = (void *)payload;
+        aesd_pool.nr_free[order]++;
+        aesd_pool.stats.pool_recycles++;
+        page = NULL;
+    } else {
+        aesd_pool.stats.page_frees++;
+    }
+    spin_unlock(&aesd_pool.lock);
+
+    if (page) {
+        put_page(page);
+    }
+}
+
+/**
+ * @return a chain of PAGE_SIZE payloads with room for @param size bytes, or NULL if no memory
+ *      is available
+ */
+struct aesd_buffer_chain *aesd_chain_alloc(size_t size)
+{
+    size_t nr = DIV_ROUND_UP(size, PAGE_SIZE);
+    struct aesd_buffer_chain *chain;
+    char *segment;
+
+    // the descriptor itself outgrows a page beyond a few megabytes
+    chain = kvmalloc(struct_size(chain, segment, nr), GFP_KERNEL);
+    if (!chain) {
+        return NULL;
+    }
+    chain->segment_size = PAGE_SIZE;
+    chain->nr_segments = 0;
+    while (chain->nr_segments < nr) {
+        segment = aesd_payload_alloc(PAGE_SIZE);
+        if (!segment) {
+            aesd_chain_free(chain);
+            return NULL;
+        }
+        chain->segment[chain->nr_segments++] = segment;
+    }
+    spin_lock(&aesd_pool.lock);
+    aesd_pool.stats.chain_allocs++;
+    spin_unlock(&aesd_pool.lock);
+    return chain;
+}
+
+/**
+ * Releases @param chain and its segments, see aesd_payload_free()
+ */
+void aesd_chain_free(struct aesd_buffer_chain *chain)
+{
+    size_t i;
+
+    if (!chain) {
+        return;
+    }
+    for (i = 0; i < chain->nr_segments; i++) {
+        aesd_payload_free(chain->segment[i]);
+    }
+    kvfree(chain);
+}
+
+struct aesd_fragment *aesd_fragment_alloc(void)
+{
+    struct aesd_fragment *frag = kmem_cache_zalloc(aesd_fragment_cache, GFP_KERNEL);
+
+    if (frag) {
+        spin_lock(&aesd_pool.lock);
+        aesd_pool.stats.fragment_allocs++;
+        spin_unlock(&aesd_pool.lock);
+    }
+    return frag;
+}
+
+void aesd_fragment_free(struct aesd_fragment *frag)
+{
+    if (frag) {
+        kmem_cache_free(aesd_fragment_cache, frag);
+    }
+}
+
+void aesd_payload_get_stats(struct aesd_payload_stats *stats)
+{
+    spin_lock(&aesd_pool.lock);
+    *stats = aesd_pool.stats;
+    spin_unlock(&aesd_pool.lock);
+}
@@ -0,0 +1,94 @@
+/*
+ * aesd-payload.h
+ *
+ *  @brief Page backed storage for aesdchar entry payloads
+ */
+
+#ifndef AESD_PAYLOAD_H
+#define AESD_PAYLOAD_H
+
+#include <linux/types.h>
+#include <linux/list.h>
+
+/**
+ * Payloads of up to (PAGE_SIZE << (AESD_PAYLOAD_POOL_ORDERS - 1)) bytes are recycled through
+ * one free list per page order instead of going back to the page allocator.
+ */
+#define AESD_PAYLOAD_POOL_ORDERS 4
+/**
+ * The maximum number of free payloads kept in each size class
+ */
+#define AESD_PAYLOAD_POOL_DEPTH AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+/**
+ * Entries larger than this are stored as a struct aesd_buffer_chain of order 0 payloads, so
+ * no allocation exceeds PAGE_ALLOC_COSTLY_ORDER, above which the page allocator gives up
+ * easily once memory is fragmented.  The largest contiguous payload is also the largest
+ * size class kept by the pool.
+ */
+#define AESD_CHAIN_THRESHOLD (PAGE_SIZE << (AESD_PAYLOAD_POOL_ORDERS - 1))
+
+struct aesd_payload_stats
+{
+    /**
+     * Payloads allocated from the page allocator
+     */
+    u64 page_allocs;
+    /**
+     * Payloads served from a size class free list
+     */
+    u64 pool_hits;
+    /**
+     * Payloads returned to a size class free list
+     */
+    u64 pool_recycles;
+    /**
+     * Payloads released to the page allocator
+     */
+    u64 page_frees;
+    /**
+     * Fragment descriptors allocated from the fragment cache
+     */
+    u64 fragment_allocs;
+    /**
+     * Page chains allocated for large entries
+     */
+    u64 chain_allocs;
+};
+
+/**
+ * A page sized piece of an entry which is still being written
+ */
+struct aesd_fragment
+{
+    struct list_head list;
+    /**
+     * A PAGE_SIZE payload from aesd_payload_alloc
+     */
+    char *data;
+    /**
+     * Number of bytes used in data
+     */
+    size_t size;
+};
+
+extern int aesd_payload_pool_init(void);
+
+extern void aesd_payload_pool_destroy(void);
+
+extern char *aesd_payload_alloc(size_t size);
+
+extern void aesd_payload_free(const char *payload);
+
+struct aesd_buffer_chain;
+
+extern struct aesd_buffer_chain *aesd_chain_alloc(size_t size);
+
+extern void aesd_chain_free(struct aesd_buffer_chain *chain);
+
+extern struct aesd_fragment *aesd_fragment_alloc(void);
+
+extern void aesd_fragment_free(struct aesd_fragment *frag);
+
+extern void aesd_payload_get_stats(struct aesd_payload_stats *stats);
+
+#endif /* AESD_PAYLOAD_H */
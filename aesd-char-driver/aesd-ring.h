@@ -0,0 +1,112 @@
+/*
+ * aesd-ring.h
+ *
+ *  @brief Generator for fixed capacity rings, specialised at compile time
+ *
+ *  AESD_RING_FIELDS() declares the members of a ring inside a struct, and AESD_RING_FUNCTIONS()
+ *  defines static inline helpers for that struct.  Both take the capacity and the counter type
+ *  as parameters, so one implementation serves the kernel driver and the userspace tests at
+ *  whatever size they are built with.
+ *
+ *  Slot storage is rounded up to a power of two, so a slot is found by masking a counter.
+ *  head counts the entries ever pushed and tail counts the entries ever evicted.  Both only
+ *  increase, wrapping at the width of their type, so the number of live entries is
+ *  head - tail and no separate full flag is needed.  The counter type must be unsigned and
+ *  able to hold the capacity.
+ */
+
+#ifndef AESD_RING_H
+#define AESD_RING_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#endif
+
+#define AESD_RING_SMEAR1(x) ((x) | ((x) >> 1))
+#define AESD_RING_SMEAR2(x) (AESD_RING_SMEAR1(x) | (AESD_RING_SMEAR1(x) >> 2))
+#define AESD_RING_SMEAR4(x) (AESD_RING_SMEAR2(x) | (AESD_RING_SMEAR2(x) >> 4))
+#define AESD_RING_SMEAR8(x) (AESD_RING_SMEAR4(x) | (AESD_RING_SMEAR4(x) >> 8))
+#define AESD_RING_SMEAR16(x) (AESD_RING_SMEAR8(x) | (AESD_RING_SMEAR8(x) >> 16))
+
+/**
+ * Number of slots backing a ring of @param capacity entries, the next power of two.
+ * A constant expression, so it can size arrays.
+ */
+#define AESD_RING_STORAGE(capacity) (AESD_RING_SMEAR16((unsigned long)(capacity) - 1) + 1)
+
+/**
+ * Declares the ring members inside a struct definition:
+ *     entry[]  slot storage, AESD_RING_STORAGE(capacity) long
+ *     head     counter of entries pushed, the slot of the next push is head masked
+ *     tail     counter of entries evicted, the slot of the oldest entry is tail masked
+ */
+#define AESD_RING_FIELDS(entry_type, capacity, index_type) \
+    entry_type entry[AESD_RING_STORAGE(capacity)]; \
+    index_type head; \
+    index_type tail
+
+/**
+ * Defines name_count, name_full, name_at, name_index_of, name_push and name_reset for
+ * @param ring_type, a struct containing AESD_RING_FIELDS() with the same parameters.
+ * Any necessary locking must be performed by the caller.
+ */
+#define AESD_RING_FUNCTIONS(name, ring_type, entry_type, capacity, index_type) \
+_Static_assert((capacity) > 0 && (unsigned long)(capacity) <= (unsigned long)(index_type)-1, \
+    #name ": counter type too narrow for capacity"); \
+\
+/* number of live entries */ \
+static inline unsigned int name##_count(const ring_type *ring) \
+{ \
+    return (index_type)(ring->head - ring->tail); \
+} \
+\
+static inline bool name##_full(const ring_type *ring) \
+{ \
+    return name##_count(ring) == (capacity); \
+} \
+\
+/* the live entry @index places after the oldest, index must be below name_count() */ \
+static inline entry_type *name##_at(ring_type *ring, unsigned int index) \
+{ \
+    return &ring->entry[(ring->tail + index) & (AESD_RING_STORAGE(capacity) - 1)]; \
+} \
+\
+/* inverse of name_at(), the position of a live entry counted from the oldest */ \
+static inline unsigned int name##_index_of(const ring_type *ring, const entry_type *entry) \
+{ \
+    return ((unsigned int)(entry - ring->entry) - ring->tail) & (AESD_RING_STORAGE(capacity) - 1); \
+} \
+\
+/* \
+ * Appends a copy of @add.  If the ring was full the oldest entry is copied to @evicted, \
+ * its slot is cleared and true is returned. \
+ */ \
+static inline bool name##_push(ring_type *ring, const entry_type *add, entry_type *evicted) \
+{ \
+    bool full = name##_full(ring); \
+    if (full) { \
+        entry_type *oldest = &ring->entry[ring->tail & (AESD_RING_STORAGE(capacity) - 1)]; \
+        *evicted = *oldest; \
+        *oldest = (entry_type){ 0 }; \
+        ring->tail++; \
+    } \
+    ring->entry[ring->head & (AESD_RING_STORAGE(capacity) - 1)] = *add; \
+    ring->head++; \
+    return full; \
+} \
+\
+static inline void name##_reset(ring_type *ring) \
+{ \
+    unsigned int i; \
+    for (i = 0; i < AESD_RING_STORAGE(capacity); i++) { \
+        ring->entry[i] = (entry_type){ 0 }; \
+    } \
+    ring->head = 0; \
+    ring->tail = 0; \
+}
+
+#endif /* AESD_RING_H */
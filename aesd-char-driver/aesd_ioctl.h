@@ -18,6 +18,8 @@
 #include <stdint.h>
 #endif
 
+#include "aesd-circular-buffer.h"
+
 /**
  * A structure to be passed by IOCTL from user space to kernel space, describing the type
  * of seek performed on the aesdchar driver
@@ -33,15 +35,101 @@ struct aesd_seekto {
     uint32_t write_cmd_offset;
 };
 
+/**
+ * Bump when the layout of struct aesd_entry_table changes
+ */
+#define AESD_ENTRY_TABLE_VERSION 2
+
+/**
+ * Location of one entry within the device contents
+ */
+struct aesd_entry_info {
+    /**
+     * The zero referenced write command, as passed to AESDCHAR_IOCSEEKTO
+     */
+    uint32_t write_cmd;
+    uint32_t reserved;
+    /**
+     * Number of bytes in the entry, chained entries may be larger than 4 GiB
+     */
+    uint64_t size;
+    /**
+     * The zero referenced offset of the first byte of the entry, as seen by read()
+     */
+    uint64_t offset;
+};
+
+/**
+ * Filled by AESDCHAR_IOCGENTRIES with every entry currently held by the device
+ */
+struct aesd_entry_table {
+    /**
+     * Set by the caller to AESD_ENTRY_TABLE_VERSION
+     */
+    uint32_t version;
+    /**
+     * Number of valid members of entry[], oldest first
+     */
+    uint32_t count;
+    /**
+     * Sum of all entry sizes
+     */
+    uint64_t total_size;
+    struct aesd_entry_info entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+};
+
+/**
+ * Bump when the layout of struct aesd_stats changes
+ */
+#define AESD_STATS_VERSION 1
+
+/**
+ * Device counters returned by AESDCHAR_IOCGSTATS, cumulative since the module was loaded
+ */
+struct aesd_stats {
+    /**
+     * Set by the caller to AESD_STATS_VERSION
+     */
+    uint32_t version;
+    /**
+     * Number of entries currently held
+     */
+    uint32_t entries;
+    uint64_t writes;
+    uint64_t write_bytes;
+    uint64_t reads;
+    uint64_t read_bytes;
+    /**
+     * Number of entries overwritten by newer writes
+     */
+    uint64_t evictions;
+    /**
+     * Sum of all entry sizes currently held
+     */
+    uint64_t total_size;
+    /**
+     * Bytes written without a terminating newline yet
+     */
+    uint64_t partial_size;
+    /**
+     * Number of reads, writes and ioctls which found the device lock held by another task
+     */
+    uint64_t lock_contended;
+};
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+// Read the entry table, the caller sets version
+#define AESDCHAR_IOCGENTRIES _IOWR(AESD_IOC_MAGIC, 2, struct aesd_entry_table)
+// Read the device counters, the caller sets version
+#define AESDCHAR_IOCGSTATS _IOWR(AESD_IOC_MAGIC, 3, struct aesd_stats)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 3
 
 
 #endif /* AESD_IOCTL_H */
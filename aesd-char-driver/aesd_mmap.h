@@ -0,0 +1,84 @@
+/*
+ * aesd_mmap.h
+ *
+ *  @brief Layout of the read-only mapping exported by mmap() on aesd char devices
+ *
+ *  The mapping starts with a header page describing the retained entries.  It is followed
+ *  by the inline arena, which holds entries small enough to share pages in fixed slots, and
+ *  then by the payloads of all other entries, each starting on a page boundary.  The
+ *  header publishes the mmap_offset of every entry, wherever it is stored.
+ */
+
+#ifndef AESD_MMAP_H
+#define AESD_MMAP_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdint.h>
+#endif
+
+#include "aesd-circular-buffer.h"
+
+/**
+ * Value of aesd_mmap_header.magic, "AESD" in ascii
+ */
+#define AESD_MMAP_MAGIC 0x41455344
+#define AESD_MMAP_VERSION 3
+
+/**
+ * Location of one retained entry inside the mapping
+ */
+struct aesd_mmap_entry {
+    /**
+     * The zero referenced offset of the entry within the device contents, as seen by read()
+     */
+    uint64_t fpos;
+    /**
+     * The offset of the entry payload from the start of the mapping.  Page aligned, unless
+     * the entry is stored in the inline arena.
+     */
+    uint64_t mmap_offset;
+    /**
+     * Number of bytes in the entry payload, chained entries may be larger than 4 GiB
+     */
+    uint64_t size;
+};
+
+/**
+ * The header page at offset 0 of the mapping.
+ *
+ * The driver increments seq before and after every update, so it is odd while an update
+ * is in progress.  A consumer reads seq, copies what it needs from the header and the
+ * payloads, then reads seq again and retries if it changed or was odd.  Payload pages
+ * move when the oldest entry is evicted; pages which are still mapped at that point are
+ * unmapped and fault in again at their new location on next access.
+ */
+struct aesd_mmap_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seq;
+    /**
+     * Number of valid members of entry[], in read order starting with the oldest entry
+     */
+    uint32_t entry_count;
+    /**
+     * Slots of the next write and of the oldest entry in the driver circular buffer, and
+     * whether it is at capacity, see struct aesd_circular_buffer
+     */
+    uint32_t in_offs;
+    uint32_t out_offs;
+    uint32_t full;
+    uint32_t reserved;
+    /**
+     * Sum of all entry sizes, the same value an lseek to SEEK_END would return
+     */
+    uint64_t total_size;
+    /**
+     * Size in bytes of the mapping currently backed by the driver, including this header
+     */
+    uint64_t map_size;
+    struct aesd_mmap_entry entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+};
+
+#endif /* AESD_MMAP_H */
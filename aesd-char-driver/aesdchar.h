@@ -10,43 +10,152 @@
 
 #include "aesd-circular-buffer.h"
 
-#define AESD_DEBUG 1  //Remove comment on this line to enable debug
+//#define AESD_DEBUG 1  //Remove comment on this line to enable user space debug
 
 #undef PDEBUG             /* undef it, just in case */
-#ifdef AESD_DEBUG
-#  ifdef __KERNEL__
-     /* This one if debugging is on, and kernel space */
-#    define PDEBUG(fmt, args...) printk( KERN_DEBUG "aesdchar: " fmt, ## args)
-#  else
-     /* This one for user space */
-#    define PDEBUG(fmt, args...) fprintf(stderr, fmt, ## args)
-#  endif
+#ifdef __KERNEL__
+   /* Kernel space uses dynamic debug, which costs a patched out branch when disabled.  Enable with
+    * echo 'module aesdchar +p' > /sys/kernel/debug/dynamic_debug/control, or build with DEBUG=y */
+#  define PDEBUG(fmt, args...) pr_debug("aesdchar: " fmt, ## args)
+#elif defined(AESD_DEBUG)
+   /* This one for user space */
+#  define PDEBUG(fmt, args...) fprintf(stderr, fmt, ## args)
 #else
 #  define PDEBUG(fmt, args...) /* not debugging: nothing */
 #endif
 
+/**
+ * Number of log2 latency buckets, the last one collects everything from 2^30 ns up
+ */
+#define AESD_LATENCY_BUCKETS 32
+
+/**
+ * Entries of up to aesd_inline_max bytes, which may not exceed AESD_INLINE_SLOT_SIZE, are copied
+ * into a slot of the device inline arena instead of getting a payload of their own.  A new entry
+ * takes the slot of its ring head counter modulo AESD_INLINE_SLOTS, which is at least one more
+ * than the capacity, so it never lands on the slot of a live entry.
+ */
+#define AESD_INLINE_SLOT_SIZE 256
+#define AESD_INLINE_SLOTS AESD_RING_STORAGE(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 1)
+#define AESD_INLINE_ARENA_SIZE (AESD_INLINE_SLOTS * AESD_INLINE_SLOT_SIZE)
+
+/**
+ * The lines of one write are added to the ring in batches of at most this many entries, the
+ * number of inline slots which never hold a live entry
+ */
+#define AESD_WRITE_BATCH (AESD_INLINE_SLOTS - AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+
+/**
+ * With aesd_stage set, writes of one complete line are queued on a per cpu stage of up to
+ * AESD_STAGE_DEPTH records without taking the device mutex.  Each staged record is numbered
+ * from the device stage_seq, and the stages are merged into the ring in that order by the next
+ * holder of the mutex, as soon as a cpu has AESD_STAGE_FLUSH_BYTES staged or its stage fills, or
+ * AESD_STAGE_DELAY_MS after the last staged write.  Records which fit an inline slot are kept in
+ * the small buffer of their stage slot and go straight to their inline slot when merged, larger
+ * ones keep the payload they were copied into.
+ */
+#define AESD_STAGE_DEPTH 16
+#define AESD_STAGE_FLUSH_BYTES (64 * 1024)
+#define AESD_STAGE_DELAY_MS 2
+
+struct aesd_staged_entry
+{
+     u64 seq;
+    /* Payload of the record, or NULL if it is in the small buffer of its slot */
+     const char *buffptr;
+     size_t size;
+};
+
+struct aesd_stage
+{
+     spinlock_t lock;
+     AESD_RING_FIELDS(struct aesd_staged_entry, AESD_STAGE_DEPTH, u8);
+    /* Total size of the staged records */
+     size_t bytes;
+    /* Bytes of the records without a payload, indexed like entry[] */
+     char small[AESD_RING_STORAGE(AESD_STAGE_DEPTH)][AESD_INLINE_SLOT_SIZE];
+};
+
+/* Where the payload of one entry lies in the mapping, for the fault handler */
+struct aesd_mmap_range
+{
+     u64 mmap_offset;
+     u64 size;
+     const char *buffptr;
+};
+
+/* Hot path counters, one copy per cpu, summed by aesd_stats_sum */
+struct aesd_dev_stats
+{
+     u64 reads;
+     u64 read_bytes;
+     u64 writes;
+     u64 write_bytes;
+     u64 evictions;
+     u64 inline_entries;
+     u64 staged_entries;
+     u64 lock_contended;
+     u64 lock_wait_ns;
+    /* Bucket n counts calls which took less than 2^n ns and at least 2^(n-1) ns */
+     u64 read_latency[AESD_LATENCY_BUCKETS];
+     u64 write_latency[AESD_LATENCY_BUCKETS];
+};
+
 struct aesd_dev
 {
-     struct mutex* mutex;
+     struct mutex mutex;
     
     /* Circular buffer */
-     struct aesd_circular_buffer* buffer;
+     struct aesd_circular_buffer buffer;
+
+    /* Page backed slots holding the payloads of small entries, AESD_INLINE_ARENA_SIZE bytes */
+     char *inline_arena;
    
-    /* Partial buffer */    
-     struct aesd_buffer_entry* partial_entry;
+    /* Fragments of a write not yet terminated by a newline, see struct aesd_fragment */
+     struct list_head partial_frags;
+
+    /* Total bytes held in partial_frags */
+     size_t partial_size;
 
-    /* Partial buffer written bool */
-     bool partial;
+    /* Readers waiting for aesd_write_iter to complete an entry */
+     wait_queue_head_t read_queue;
 
-    /* Seek information */
-     loff_t seekto_position;
+    /* Number of entries completed by aesd_write_iter */
+     uint64_t write_seq;
 
-    /* Seek bool */
-     bool seek;
+    /* Per cpu queues of writes not yet added to buffer, see AESD_STAGE_DEPTH */
+     struct aesd_stage __percpu *stage;
+
+    /* Sequence number of the last record staged, and of the last one merged into buffer */
+     atomic64_t stage_seq;
+     u64 stage_merged;
+
+    /* Merges the stages AESD_STAGE_DELAY_MS after a staged write */
+     struct delayed_work stage_work;
+
+    /* Header page at offset 0 of read only mappings, see aesd_mmap.h */
+     struct aesd_mmap_header* mmap_header;
+
+    /*
+     * Mapping of every file opened on this device, whichever device node it came through, so
+     * moving entry payloads invalidates all mappings of them.  aesd_open installs it.
+     */
+     struct address_space mmap_mapping;
+
+    /*
+     * Payload entries of the mapping as last published by aesd_mmap_update, looked up by the
+     * fault handler under mmap_ranges_lock instead of the mutex
+     */
+     spinlock_t mmap_ranges_lock;
+     unsigned int mmap_nranges;
+     struct aesd_mmap_range mmap_ranges[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+
+    /* Per device counters */
+     struct aesd_dev_stats __percpu *stats;
 
     /* Char device structure */
      struct cdev cdev;    
-};
+} ____cacheline_aligned_in_smp;
 
 loff_t aesd_llseek(struct file *filp, loff_t off, int whence);
 
@@ -0,0 +1,170 @@
+/*
+ * aesdchar_trace.h
+ *
+ *  @brief Tracepoints for the aesdchar driver
+ *
+ *  The events show up under /sys/kernel/tracing/events/aesdchar and can be recorded with
+ *  perf record -e 'aesdchar:*' or trace-cmd record -e aesdchar.  Each one costs a patched
+ *  out branch while disabled.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM aesdchar
+
+#if !defined(AESDCHAR_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define AESDCHAR_TRACE_H
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(aesd_io_enter,
+    TP_PROTO(unsigned int minor, size_t count, loff_t pos),
+    TP_ARGS(minor, count, pos),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(size_t, count)
+        __field(loff_t, pos)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->count = count;
+        __entry->pos = pos;
+    ),
+    TP_printk("minor=%u count=%zu pos=%lld", __entry->minor, __entry->count, __entry->pos)
+);
+
+DEFINE_EVENT(aesd_io_enter, aesd_read_enter,
+    TP_PROTO(unsigned int minor, size_t count, loff_t pos),
+    TP_ARGS(minor, count, pos)
+);
+
+DEFINE_EVENT(aesd_io_enter, aesd_write_enter,
+    TP_PROTO(unsigned int minor, size_t count, loff_t pos),
+    TP_ARGS(minor, count, pos)
+);
+
+DECLARE_EVENT_CLASS(aesd_io_exit,
+    TP_PROTO(unsigned int minor, ssize_t ret, loff_t pos),
+    TP_ARGS(minor, ret, pos),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(ssize_t, ret)
+        __field(loff_t, pos)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->ret = ret;
+        __entry->pos = pos;
+    ),
+    TP_printk("minor=%u ret=%zd pos=%lld", __entry->minor, __entry->ret, __entry->pos)
+);
+
+DEFINE_EVENT(aesd_io_exit, aesd_read_exit,
+    TP_PROTO(unsigned int minor, ssize_t ret, loff_t pos),
+    TP_ARGS(minor, ret, pos)
+);
+
+DEFINE_EVENT(aesd_io_exit, aesd_write_exit,
+    TP_PROTO(unsigned int minor, ssize_t ret, loff_t pos),
+    TP_ARGS(minor, ret, pos)
+);
+
+TRACE_EVENT(aesd_llseek,
+    TP_PROTO(unsigned int minor, loff_t offset, int whence, loff_t ret),
+    TP_ARGS(minor, offset, whence, ret),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(loff_t, offset)
+        __field(int, whence)
+        __field(loff_t, ret)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->offset = offset;
+        __entry->whence = whence;
+        __entry->ret = ret;
+    ),
+    TP_printk("minor=%u offset=%lld whence=%d ret=%lld", __entry->minor, __entry->offset,
+        __entry->whence, __entry->ret)
+);
+
+TRACE_EVENT(aesd_ioctl,
+    TP_PROTO(unsigned int minor, unsigned int cmd, long ret),
+    TP_ARGS(minor, cmd, ret),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(unsigned int, cmd)
+        __field(long, ret)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->cmd = cmd;
+        __entry->ret = ret;
+    ),
+    TP_printk("minor=%u cmd=%#x ret=%ld", __entry->minor, __entry->cmd, __entry->ret)
+);
+
+TRACE_EVENT(aesd_lock_wait,
+    TP_PROTO(unsigned int minor, bool contended, u64 wait_ns),
+    TP_ARGS(minor, contended, wait_ns),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(bool, contended)
+        __field(u64, wait_ns)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->contended = contended;
+        __entry->wait_ns = wait_ns;
+    ),
+    TP_printk("minor=%u contended=%d wait_ns=%llu", __entry->minor, __entry->contended,
+        __entry->wait_ns)
+);
+
+TRACE_EVENT(aesd_buffer_add_entry,
+    TP_PROTO(const void *buffer, size_t size, size_t evicted_size, bool evicted, size_t total_size),
+    TP_ARGS(buffer, size, evicted_size, evicted, total_size),
+    TP_STRUCT__entry(
+        __field(const void *, buffer)
+        __field(size_t, size)
+        __field(size_t, evicted_size)
+        __field(bool, evicted)
+        __field(size_t, total_size)
+    ),
+    TP_fast_assign(
+        __entry->buffer = buffer;
+        __entry->size = size;
+        __entry->evicted_size = evicted_size;
+        __entry->evicted = evicted;
+        __entry->total_size = total_size;
+    ),
+    TP_printk("buffer=%p size=%zu evicted=%d evicted_size=%zu total_size=%zu", __entry->buffer,
+        __entry->size, __entry->evicted, __entry->evicted_size, __entry->total_size)
+);
+
+TRACE_EVENT(aesd_buffer_add_entries,
+    TP_PROTO(const void *buffer, size_t count, size_t evicted, size_t total_size),
+    TP_ARGS(buffer, count, evicted, total_size),
+    TP_STRUCT__entry(
+        __field(const void *, buffer)
+        __field(size_t, count)
+        __field(size_t, evicted)
+        __field(size_t, total_size)
+    ),
+    TP_fast_assign(
+        __entry->buffer = buffer;
+        __entry->count = count;
+        __entry->evicted = evicted;
+        __entry->total_size = total_size;
+    ),
+    TP_printk("buffer=%p count=%zu evicted=%zu total_size=%zu", __entry->buffer, __entry->count,
+        __entry->evicted, __entry->total_size)
+);
+
+#endif /* AESDCHAR_TRACE_H */
+
+/* This part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE aesdchar_trace
+#include <trace/define_trace.h>
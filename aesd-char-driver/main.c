@@ -19,16 +19,253 @@
 #include <linux/fs.h> // file_operations
 #include <linux/slab.h>
 #include <linux/mutex.h>
+#include <linux/mm.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/version.h>
+#include <linux/spinlock.h>
+#include <linux/atomic.h>
+#include <linux/workqueue.h>
+#include <linux/srcu.h>
 #include "aesdchar.h"
 #include "aesd-circular-buffer.h"
 #include "aesd_ioctl.h"
+#include "aesd_mmap.h"
+#include "aesd-payload.h"
+
+#define CREATE_TRACE_POINTS
+#include "aesdchar_trace.h"
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
+int aesd_nr_devs = 1;
+bool aesd_follow = false;
+unsigned int aesd_inline_max = AESD_INLINE_SLOT_SIZE;
+bool aesd_stage = false;
+
+module_param(aesd_nr_devs, int, S_IRUGO);
+MODULE_PARM_DESC(aesd_nr_devs, "Number of independent aesdchar devices to create");
+module_param(aesd_follow, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(aesd_follow, "Block reads at the end of the data until a new entry is written, unless opened with O_NONBLOCK");
+module_param(aesd_inline_max, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(aesd_inline_max, "Largest entry stored in the inline arena rather than its own payload, at most "
+        __stringify(AESD_INLINE_SLOT_SIZE) ", 0 to disable");
+module_param(aesd_stage, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(aesd_stage, "Queue single line writes on per cpu stages and add them to the ring in batches");
 
 MODULE_AUTHOR("asabbagh4");
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct aesd_dev aesd_device;
+struct aesd_dev **aesd_devices;
+static struct kmem_cache *aesd_dev_cache;
+static struct dentry *aesd_debugfs_dir;
+
+/*
+ * aesd_stage_count(), _full(), _at(), _push() and friends for the per cpu stages
+ */
+AESD_RING_FUNCTIONS(aesd_stage, struct aesd_stage, struct aesd_staged_entry, AESD_STAGE_DEPTH, u8)
+
+static void aesd_stage_merge(struct aesd_dev *dev);
+
+/**
+ * Takes the device mutex, queueing behind any other waiters, and merges any staged writes so
+ * the holder sees them in the ring.  Acquisitions which find it held are counted in
+ * lock_contended and their wait in lock_wait_ns.
+ * @param nonblock fail with -EAGAIN rather than wait, for O_NONBLOCK files
+ * @return 0 with the mutex held, -EAGAIN, or -ERESTARTSYS if a signal arrived while waiting
+ */
+static int aesd_lock(struct aesd_dev *dev, bool nonblock)
+{
+    u64 start;
+
+    if (mutex_trylock(&dev->mutex)) {
+        trace_aesd_lock_wait(MINOR(dev->cdev.dev), false, 0);
+        aesd_stage_merge(dev);
+        return 0;
+    }
+    this_cpu_inc(dev->stats->lock_contended);
+    if (nonblock) {
+        trace_aesd_lock_wait(MINOR(dev->cdev.dev), true, 0);
+        return -EAGAIN;
+    }
+    start = ktime_get_ns();
+    if (mutex_lock_interruptible(&dev->mutex)) {
+        return -ERESTARTSYS;
+    }
+    start = ktime_get_ns() - start;
+    this_cpu_add(dev->stats->lock_wait_ns, start);
+    trace_aesd_lock_wait(MINOR(dev->cdev.dev), true, start);
+    aesd_stage_merge(dev);
+    return 0;
+}
+
+static inline unsigned int aesd_latency_bucket(u64 ns)
+{
+    return min_t(unsigned int, fls64(ns), AESD_LATENCY_BUCKETS - 1);
+}
+
+/**
+ * Sums the per cpu counters of @param dev into @param sum
+ */
+static void aesd_stats_sum(struct aesd_dev *dev, struct aesd_dev_stats *sum)
+{
+    const u64 *src;
+    u64 *dst = (u64 *)sum;
+    unsigned int i;
+    int cpu;
+
+    BUILD_BUG_ON(sizeof(struct aesd_dev_stats) % sizeof(u64));
+    memset(sum, 0, sizeof(*sum));
+    for_each_possible_cpu(cpu) {
+        src = (const u64 *)per_cpu_ptr(dev->stats, cpu);
+        for (i = 0; i < sizeof(*sum) / sizeof(u64); i++) {
+            dst[i] += src[i];
+        }
+    }
+}
+
+/**
+ * @return the largest entry currently stored inline, see AESD_INLINE_SLOT_SIZE
+ */
+static inline size_t aesd_inline_limit(void)
+{
+    return min_t(size_t, READ_ONCE(aesd_inline_max), AESD_INLINE_SLOT_SIZE);
+}
+
+static inline bool aesd_is_inline(struct aesd_dev *dev, const char *data)
+{
+    return data >= dev->inline_arena && data < dev->inline_arena + AESD_INLINE_ARENA_SIZE;
+}
+
+/**
+ * @return the inline slot for the entry @param nth places after the next one added to the ring,
+ * nth must be below AESD_WRITE_BATCH.  Must be called with the device mutex held.
+ */
+static inline char *aesd_inline_slot(struct aesd_dev *dev, unsigned int nth)
+{
+    return dev->inline_arena +
+            ((dev->buffer.head + nth) & (AESD_INLINE_SLOTS - 1)) * AESD_INLINE_SLOT_SIZE;
+}
+
+/**
+ * @return storage for an entry of @param size bytes which will be the @param nth added by the
+ *      current batch: its aesd_inline_slot() if size is at most @param inline_max, a payload up
+ *      to AESD_CHAIN_THRESHOLD, and a tagged page chain beyond that.  NULL if no memory is
+ *      available.  Inline slots require the device mutex to be held.
+ */
+static char *aesd_entry_alloc(struct aesd_dev *dev, unsigned int nth, size_t size,
+        size_t inline_max)
+{
+    struct aesd_buffer_chain *chain;
+
+    if (size <= inline_max) {
+        return aesd_inline_slot(dev, nth);
+    }
+    if (size <= AESD_CHAIN_THRESHOLD) {
+        return aesd_payload_alloc(size);
+    }
+    chain = aesd_chain_alloc(size);
+    return chain ? (char *)aesd_buffer_chain_ptr(chain) : NULL;
+}
+
+/**
+ * Releases entry storage from aesd_entry_alloc()
+ */
+static void aesd_entry_free(struct aesd_dev *dev, const char *data)
+{
+    struct aesd_buffer_chain *chain = aesd_buffer_entry_chain(data);
+
+    if (chain) {
+        aesd_chain_free(chain);
+    } else if (!aesd_is_inline(dev, data)) {
+        aesd_payload_free(data);
+    }
+}
+
+/**
+ * Copies @param len bytes from @param src to @param offset bytes into entry storage @param data
+ */
+static void aesd_entry_write(char *data, size_t offset, const char *src, size_t len)
+{
+    struct aesd_buffer_chain *chain = aesd_buffer_entry_chain(data);
+    size_t within;
+    size_t chunk;
+
+    if (!chain) {
+        memcpy(data + offset, src, len);
+        return;
+    }
+    while (len) {
+        within = offset % chain->segment_size;
+        chunk = min(len, chain->segment_size - within);
+        memcpy(chain->segment[offset / chain->segment_size] + within, src, chunk);
+        offset += chunk;
+        src += chunk;
+        len -= chunk;
+    }
+}
+
+/*
+ * Faults insert their page before leaving this, so an update which moves payloads can wait for
+ * the faults still using the old layout before it unmaps it.
+ */
+DEFINE_STATIC_SRCU(aesd_mmap_srcu);
+
+/**
+ * Republish the ring layout in the mmap header page and in the ranges the fault handler looks up.
+ * Must be called with the device mutex held after every change to the circular buffer, and
+ * before the payloads of evicted entries are freed.
+ * @param moved true if existing payloads changed location in the mapping, in which case any pages
+ *      already mapped into userspace are unmapped so they fault in again at their new location.
+ *      The inline arena never moves.
+ */
+static void aesd_mmap_update(struct aesd_dev *dev, bool moved)
+{
+    struct aesd_mmap_header *hdr = dev->mmap_header;
+    struct aesd_circular_buffer *buffer = &dev->buffer;
+    unsigned int count = aesd_circular_buffer_count(buffer);
+    uint64_t map_offset = PAGE_SIZE + PAGE_ALIGN(AESD_INLINE_ARENA_SIZE);
+    unsigned int nranges = 0;
+    unsigned int i;
+
+    spin_lock(&dev->mmap_ranges_lock);
+    hdr->seq++;
+    smp_wmb();
+    for (i = 0; i < count; i++) {
+        struct aesd_buffer_entry *entry = aesd_circular_buffer_at(buffer, i);
+        hdr->entry[i].fpos = aesd_circular_buffer_offset_of(buffer, i);
+        hdr->entry[i].size = entry->size;
+        if (aesd_is_inline(dev, entry->buffptr)) {
+            hdr->entry[i].mmap_offset = PAGE_SIZE + (entry->buffptr - dev->inline_arena);
+        } else {
+            hdr->entry[i].mmap_offset = map_offset;
+            dev->mmap_ranges[nranges].mmap_offset = map_offset;
+            dev->mmap_ranges[nranges].size = entry->size;
+            dev->mmap_ranges[nranges].buffptr = entry->buffptr;
+            nranges++;
+            map_offset += PAGE_ALIGN(entry->size);
+        }
+    }
+    dev->mmap_nranges = nranges;
+    hdr->entry_count = count;
+    hdr->in_offs = buffer->head & (AESD_CIRCULAR_BUFFER_STORAGE - 1);
+    hdr->out_offs = buffer->tail & (AESD_CIRCULAR_BUFFER_STORAGE - 1);
+    hdr->full = aesd_circular_buffer_full(buffer);
+    hdr->total_size = buffer->total_size;
+    hdr->map_size = map_offset;
+    smp_wmb();
+    hdr->seq++;
+    spin_unlock(&dev->mmap_ranges_lock);
+
+    if (moved && mapping_mapped(&dev->mmap_mapping)) {
+        synchronize_srcu(&aesd_mmap_srcu);
+        unmap_mapping_range(&dev->mmap_mapping, PAGE_SIZE + PAGE_ALIGN(AESD_INLINE_ARENA_SIZE), 0, 1);
+    }
+}
 
 int aesd_open(struct inode *inode, struct file *filp)
 {
@@ -37,6 +274,8 @@ int aesd_open(struct inode *inode, struct file *filp)
     struct aesd_dev *dev;
     dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
     filp->private_data = dev;
+    // /dev/aesdchar and /dev/aesdcharN are different inodes, share one mapping between them
+    filp->f_mapping = &dev->mmap_mapping;
     return 0;
 }
 
@@ -47,231 +286,755 @@ int aesd_release(struct inode *inode, struct file *filp)
     return 0;
 }
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+/**
+ * A read takes at most this many segments of the ring under the mutex at a time, and copies them
+ * to the reader after dropping it
+ */
+#define AESD_READ_SEGMENTS 16
+
+struct aesd_read_segment
+{
+    const char *data;
+    size_t len;
+    /* Reference on the payload page holding data, NULL if data was copied to the bounce page */
+    struct page *page;
+};
+
+/**
+ * Takes the segments of up to @param count bytes from @param f_pos.  Payload pages get a reference
+ * of their own, as the entry may be evicted and its payload freed once the mutex is dropped.
+ * Inline slots are reused by later writes instead, so their bytes are copied to @param bounce, a
+ * page allocated on first use.  Must be called with the device mutex held.
+ * @param bytes set to the total length of the segments taken
+ * @return the number of segments taken, 0 if out of memory
+ */
+static unsigned int aesd_read_snapshot(struct aesd_dev *dev, loff_t f_pos, size_t count,
+        struct aesd_read_segment *seg, char **bounce, size_t *bytes)
+{
+    struct aesd_circular_buffer_iter iter;
+    size_t bounced = 0;
+    unsigned int n = 0;
+    const char *data;
+    size_t len;
+
+    *bytes = 0;
+    aesd_circular_buffer_iter_init(&iter, &dev->buffer, f_pos, count);
+    while (n < AESD_READ_SEGMENTS && aesd_circular_buffer_iter_next(&iter, &data, &len)) {
+        if (aesd_is_inline(dev, data)) {
+            if (!*bounce) {
+                *bounce = aesd_payload_alloc(PAGE_SIZE);
+            }
+            if (!*bounce || bounced + len > PAGE_SIZE) {
+                break;
+            }
+            seg[n].data = memcpy(*bounce + bounced, data, len);
+            seg[n].page = NULL;
+            bounced += len;
+        } else {
+            // payloads are compound, a reference on any page keeps all of it
+            seg[n].data = data;
+            seg[n].page = virt_to_page(data);
+            get_page(seg[n].page);
+        }
+        seg[n++].len = len;
+        *bytes += len;
+    }
+    return n;
+}
+
+/**
+ * Copies the @param n segments taken by aesd_read_snapshot into @param to, one copy_to_iter per
+ * segment so a single call can scatter across all the segments of a readv or io_uring request,
+ * and drops their page references.
+ * @return the number of bytes copied, short if the user buffer faulted
+ */
+static size_t aesd_read_copy(struct aesd_read_segment *seg, unsigned int n, struct iov_iter *to)
 {
-    ssize_t retval = 0;
     size_t read_count = 0;
-    uint i;
-    uint k;
-    size_t start_entry_index;
-    struct aesd_dev *aesd_device = filp->private_data; 
-    char *tmp_buf = kmalloc(count, GFP_KERNEL);
-    i = mutex_is_locked(aesd_device->mutex);
-    if (i) {
-        return -ENOMEM;
-    } else {
+    bool fault = false;
+    size_t copied;
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        if (!fault) {
+            copied = copy_to_iter(seg[i].data, seg[i].len, to);
+            read_count += copied;
+            fault = copied < seg[i].len;
+        }
+        if (seg[i].page) {
+            put_page(seg[i].page);
+        }
     }
-    mutex_lock(aesd_device->mutex);
-    i = mutex_is_locked(aesd_device->mutex);
+    return read_count;
+}
+
+static ssize_t aesd_do_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct file *filp = iocb->ki_filp;
+    struct aesd_dev *aesd_device = filp->private_data;
+    bool nonblock = (filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+    struct aesd_read_segment seg[AESD_READ_SEGMENTS];
+    size_t read_count = 0;
+    char *bounce = NULL;
+    uint64_t base;
+    unsigned int n;
+    size_t copied;
+    size_t bytes;
+    int i;
+
+    if (iov_iter_count(to) == 0) {
+        return 0;
+    }
+    i = aesd_lock(aesd_device, nonblock);
     if (i) {
-    } else {
-	return -ENOMEM;
+        return i;
     }
     
-    if (*f_pos >= aesd_device->buffer->total_size) {
+    while (iocb->ki_pos >= aesd_device->buffer.total_size) {
         // don't have enough data for this position
-	// this will happen if the function returns null, so maybe just put this in there?
-	// what to do? return an error?
-	mutex_unlock(aesd_device->mutex);
-	return 0;
+        uint64_t write_seq = aesd_device->write_seq;
+        uint64_t evicted_bytes = aesd_device->buffer.base_offset;
+
+        if (!aesd_follow || nonblock) {
+            mutex_unlock(&aesd_device->mutex);
+            return aesd_follow ? -EAGAIN : 0;
+        }
+        // tail follow: sleep until aesd_write_iter completes another entry
+        mutex_unlock(&aesd_device->mutex);
+        if (wait_event_interruptible(aesd_device->read_queue,
+                    READ_ONCE(aesd_device->write_seq) != write_seq)) {
+            return -ERESTARTSYS;
+        }
+        i = aesd_lock(aesd_device, false);
+        if (i) {
+            return i;
+        }
+        // keep pointing at the same byte if older entries were evicted while sleeping
+        evicted_bytes = aesd_device->buffer.base_offset - evicted_bytes;
+        iocb->ki_pos = (iocb->ki_pos > evicted_bytes) ? iocb->ki_pos - evicted_bytes : 0;
+    }
+
+    // no user memory (possibly a mapping of this device) is touched with the mutex held, each
+    // round takes its segments under it and copies them after unlocking
+    for (;;) {
+        base = aesd_device->buffer.base_offset;
+        n = aesd_read_snapshot(aesd_device, iocb->ki_pos, iov_iter_count(to), seg, &bounce, &bytes);
+        mutex_unlock(&aesd_device->mutex);
+        copied = aesd_read_copy(seg, n, to);
+        // update file position
+        iocb->ki_pos += copied;
+        read_count += copied;
+        if (n == 0 || copied < bytes || iov_iter_count(to) == 0 || aesd_lock(aesd_device, nonblock)) {
+            break;
+        }
+        // keep pointing at the next byte if older entries were evicted while unlocked
+        base = aesd_device->buffer.base_offset - base;
+        iocb->ki_pos = (iocb->ki_pos > base) ? iocb->ki_pos - base : 0;
+        if (iocb->ki_pos >= aesd_device->buffer.total_size) {
+            mutex_unlock(&aesd_device->mutex);
+            break;
+        }
+    }
+    if (bounce) {
+        aesd_payload_free(bounce);
     }
 
+    if (read_count == 0) {
+        // nothing copied although data exists at this position means the user buffer faulted
+        return n ? -EFAULT : -ENOMEM;
+    }
+    return read_count;
+}
 
-    size_t *byte_offset = kmalloc(sizeof(size_t),GFP_KERNEL);
-    struct aesd_buffer_entry *point_entry;
+/**
+ * Adds @param count complete entries to the circular buffer, taking ownership of their data,
+ * which is either a payload or the aesd_inline_slot() matching its place in the batch.
+ * count must not exceed AESD_WRITE_BATCH.  Must be called with the device mutex held.
+ */
+static void aesd_add_entries(struct aesd_dev *aesd_device, const struct aesd_buffer_entry *entries,
+        unsigned int count)
+{
+    const char *evicted[AESD_WRITE_BATCH];
+    size_t nevicted;
+    bool moved = false;
+    unsigned int i;
 
-    if(aesd_device->seek) {
-        *f_pos = aesd_device->seekto_position;
-	aesd_device->seek = false;
+    for (i = 0; i < count; i++) {
+        if (aesd_is_inline(aesd_device, entries[i].buffptr)) {
+            this_cpu_inc(aesd_device->stats->inline_entries);
+        }
+    }
+    // add created entries to the buffer, releasing the payloads of any entries they replaced
+    nevicted = aesd_circular_buffer_add_entries(&aesd_device->buffer, entries, count, evicted);
+    this_cpu_add(aesd_device->stats->evictions, nevicted);
+    for (i = 0; i < nevicted; i++) {
+        moved |= !aesd_is_inline(aesd_device, evicted[i]);
+    }
+    // unmap the evicted payloads first so they can be recycled
+    aesd_mmap_update(aesd_device, moved);
+    for (i = 0; i < nevicted; i++) {
+        aesd_entry_free(aesd_device, evicted[i]);
     }
 
-    if (*f_pos != 0) {
-        point_entry = aesd_circular_buffer_find_entry_offset_for_fpos(aesd_device->buffer, *f_pos, byte_offset); 
-	// TODO if the entry is NULL
-	if (point_entry == NULL) {
-	    start_entry_index = 0;
-	    *byte_offset = 0;
-        } else {
-            // find the index of the returned entry
-            for (i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) { 
-	        if (point_entry == &(aesd_device->buffer->entry[i])) {
-                    start_entry_index = i;
-	            break;
-	        }
+    // wake readers blocked in aesd_read_iter and pollers
+    WRITE_ONCE(aesd_device->write_seq, aesd_device->write_seq + 1);
+    wake_up_interruptible_poll(&aesd_device->read_queue, EPOLLIN | EPOLLRDNORM);
+}
+
+/**
+ * Adds every staged record to the ring in stage_seq order.  Sequence numbers are handed out
+ * under the stage lock together with the push, so they have no gaps and the oldest record of
+ * each stage is the lowest numbered one there.  Must be called with the device mutex held.
+ */
+static void aesd_stage_merge(struct aesd_dev *dev)
+{
+    u64 last = atomic64_read(&dev->stage_seq);
+    struct aesd_buffer_entry batch[AESD_WRITE_BATCH];
+    struct aesd_staged_entry *rec;
+    struct aesd_stage *stage;
+    unsigned int nbatch = 0;
+    bool locked = false;
+    bool found;
+    int cpu;
+
+    while (dev->stage_merged < last) {
+        found = false;
+        for_each_possible_cpu(cpu) {
+            stage = per_cpu_ptr(dev->stage, cpu);
+            // a stage which looks empty may be in the middle of a push, see below
+            if (!locked && READ_ONCE(stage->head) == READ_ONCE(stage->tail)) {
+                continue;
+            }
+            // take the run of consecutive records this cpu holds
+            spin_lock(&stage->lock);
+            // records staged after last was read are left for the next merge
+            while (nbatch < AESD_WRITE_BATCH && aesd_stage_count(stage) &&
+                    (rec = aesd_stage_at(stage, 0))->seq == dev->stage_merged + 1 &&
+                    rec->seq <= last) {
+                batch[nbatch].buffptr = rec->buffptr;
+                if (!rec->buffptr) {
+                    batch[nbatch].buffptr = memcpy(aesd_inline_slot(dev, nbatch),
+                            stage->small[rec - stage->entry], rec->size);
+                }
+                batch[nbatch++].size = rec->size;
+                stage->bytes -= rec->size;
+                *rec = (struct aesd_staged_entry){ 0 };
+                stage->tail++;
+                dev->stage_merged++;
+                found = true;
+            }
+            spin_unlock(&stage->lock);
+
+            if (nbatch == AESD_WRITE_BATCH) {
+                aesd_add_entries(dev, batch, nbatch);
+                nbatch = 0;
             }
         }
-    } else {
-        start_entry_index = aesd_device->buffer->out_offs;
-	*byte_offset = 0;
+        if (!found && locked) {
+            // cannot happen, every stage lock was taken after the records up to last were pushed
+            break;
+        }
+        // the next record was numbered but not yet pushed when its stage was checked: take
+        // every stage lock in the next pass, which waits for the push instead of spinning
+        locked = !found;
+    }
+    if (nbatch) {
+        aesd_add_entries(dev, batch, nbatch);
     }
+}
 
+static void aesd_stage_work(struct work_struct *work)
+{
+    struct aesd_dev *dev = container_of(to_delayed_work(work), struct aesd_dev, stage_work);
 
-    if (!aesd_device->buffer->full) {   
-        read_count += aesd_circular_buffer_read_helper(aesd_device->buffer, 
-			start_entry_index, aesd_device->buffer->in_offs, 
-			tmp_buf, count, byte_offset);
-    } else {
-        if (aesd_device->buffer->out_offs <= start_entry_index) {
-	    // seeked position is on the back of the buffer
-	    read_count += aesd_circular_buffer_read_helper(aesd_device->buffer, 
-                        start_entry_index, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, 
-                        tmp_buf, count, byte_offset);
-	    read_count += aesd_circular_buffer_read_helper(aesd_device->buffer,
-                        0, aesd_device->buffer->out_offs,
-                        tmp_buf, count, byte_offset);
-	} else {
-	    // seeked position is on the front of the buffer
-	    read_count += aesd_circular_buffer_read_helper(aesd_device->buffer, 
-                        start_entry_index, aesd_device->buffer->out_offs, 
-                        tmp_buf, count, byte_offset);
-	}
-    }
-    mutex_unlock(aesd_device->mutex);
-    i = mutex_is_locked(aesd_device->mutex);
-    if (!i) {
+    mutex_lock(&dev->mutex);
+    aesd_stage_merge(dev);
+    mutex_unlock(&dev->mutex);
+}
+
+/**
+ * Queues the single line held in @param data on the stage of this cpu.  With @param copy the
+ * line, at most AESD_INLINE_SLOT_SIZE bytes, is copied into the small buffer of its stage slot
+ * and data stays with the caller; otherwise data is entry storage and the stage takes ownership
+ * of it.  Merges the stages right away once this one holds AESD_STAGE_FLUSH_BYTES or is full,
+ * and otherwise schedules stage_work.
+ * @return false if the stage was full and data was not queued
+ */
+static bool aesd_stage_write(struct aesd_dev *dev, const char *data, size_t count, bool copy)
+{
+    struct aesd_staged_entry rec = { .buffptr = copy ? NULL : data, .size = count };
+    struct aesd_stage *stage = get_cpu_ptr(dev->stage);
+    bool staged = false;
+    bool flush = false;
+
+    spin_lock(&stage->lock);
+    if (!aesd_stage_full(stage)) {
+        if (copy) {
+            memcpy(stage->small[stage->head & (AESD_RING_STORAGE(AESD_STAGE_DEPTH) - 1)], data,
+                    count);
+        }
+        rec.seq = atomic64_inc_return(&dev->stage_seq);
+        aesd_stage_push(stage, &rec, &rec);
+        stage->bytes += count;
+        flush = stage->bytes >= AESD_STAGE_FLUSH_BYTES || aesd_stage_full(stage);
+        staged = true;
+    }
+    spin_unlock(&stage->lock);
+    put_cpu_ptr(dev->stage);
+
+    if (!staged) {
+        return false;
+    }
+    this_cpu_inc(dev->stats->staged_entries);
+    if (flush && !aesd_lock(dev, false)) {
+        mutex_unlock(&dev->mutex);
     } else {
-	return -ENOMEM;
+        schedule_delayed_work(&dev->stage_work, msecs_to_jiffies(AESD_STAGE_DELAY_MS));
     }
-    // unlock data
-  //  mutex_unlock(aesd_device->mutex);
+    return true;
+}
 
-    retval = copy_to_user(buf, tmp_buf, count);
-    if (retval) {
-	    // copy data to user failed
-	    // TODO
+/**
+ * Drops data appended to the partial entry after its size was @param size bytes.
+ */
+static void aesd_partial_truncate(struct aesd_dev *aesd_device, size_t size)
+{
+    struct aesd_fragment *frag;
+
+    while (aesd_device->partial_size > size) {
+        frag = list_last_entry(&aesd_device->partial_frags, struct aesd_fragment, list);
+        if (aesd_device->partial_size - frag->size >= size) {
+            aesd_device->partial_size -= frag->size;
+            list_del(&frag->list);
+            aesd_payload_free(frag->data);
+            aesd_fragment_free(frag);
+        } else {
+            frag->size -= aesd_device->partial_size - size;
+            aesd_device->partial_size = size;
+        }
     }
-    
-    // TODO release mutex
-    retval = read_count;
-    
-    // free memory used locally
-    kfree(byte_offset);
-    kfree(tmp_buf);
-    
-    // update file position and return
-    if ((*f_pos) < aesd_device->buffer->total_size) {
-	(*f_pos) += read_count;
-        return retval;
+}
+
+/**
+ * Appends @param count bytes from @param buf to the partial entry, filling the last fragment
+ * before adding new page sized ones, so each byte is copied once however the entry is split.
+ */
+static int aesd_partial_append(struct aesd_dev *aesd_device, const char *buf, size_t count)
+{
+    struct aesd_fragment *frag = NULL;
+    size_t done = 0;
+    size_t chunk;
+
+    if (!list_empty(&aesd_device->partial_frags)) {
+        frag = list_last_entry(&aesd_device->partial_frags, struct aesd_fragment, list);
+    }
+    while (done < count) {
+        if (!frag || frag->size == PAGE_SIZE) {
+            frag = aesd_fragment_alloc();
+            if (!frag) {
+                return -ENOMEM;
+            }
+            frag->data = aesd_payload_alloc(PAGE_SIZE);
+            if (!frag->data) {
+                aesd_fragment_free(frag);
+                return -ENOMEM;
+            }
+            list_add_tail(&frag->list, &aesd_device->partial_frags);
+        }
+        chunk = min(count - done, PAGE_SIZE - frag->size);
+        memcpy(frag->data + frag->size, buf + done, chunk);
+        frag->size += chunk;
+        aesd_device->partial_size += chunk;
+        done += chunk;
     }
     return 0;
 }
 
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
+/**
+ * Copies the fragments of the partial entry, if any, into entry storage @param data, which must
+ * have room for partial_size bytes, and releases them.
+ */
+static void aesd_partial_linearize(struct aesd_dev *aesd_device, char *data)
 {
-    uint i;
-    ssize_t retval = -ENOMEM;
-    ssize_t write_size = count;
-    struct aesd_dev *aesd_device = filp->private_data;
-    // create entry from buffer and count provided
-    struct aesd_buffer_entry *add_entry = kmalloc(sizeof(*add_entry),GFP_KERNEL); 
-    // kmalloc a buffer to store the data we are given
-    char *data = kmalloc(count, GFP_KERNEL);
-    char *tmp = kmalloc(count + aesd_device->partial_entry->size, GFP_KERNEL);
-    
-    retval = copy_from_user(data, buf, count);
-    if (retval) {
-	    // copy data to user failed
-	    PDEBUG("copy_to_user failed. Number of failed bytes: %li", retval);
-	    // TODO
+    struct aesd_fragment *frag, *next;
+    size_t offset = 0;
+
+    list_for_each_entry_safe(frag, next, &aesd_device->partial_frags, list) {
+        aesd_entry_write(data, offset, frag->data, frag->size);
+        offset += frag->size;
+        list_del(&frag->list);
+        aesd_payload_free(frag->data);
+        aesd_fragment_free(frag);
     }
-   
-    // lock data
-    i = mutex_is_locked(aesd_device->mutex);
-    if (i) {
-        return -ENOMEM;
+    aesd_device->partial_size = 0;
+}
+
+/**
+ * Adds an entry for each line of @param data, the first one completing the partial entry, and
+ * appends any text after the last newline to the partial entry.
+ * Must be called with the device mutex held.
+ * @return count, or if storage ran out the number of bytes consumed until then, or -ENOMEM if
+ *      there were none
+ */
+static ssize_t aesd_write_lines(struct aesd_dev *aesd_device, const char *data, size_t count,
+        size_t inline_max)
+{
+    struct aesd_buffer_entry batch[AESD_WRITE_BATCH];
+    unsigned int nbatch = 0;
+    size_t partial_size;
+    size_t pos = 0;
+    const char *newline;
+    int err = 0;
+
+    while ((newline = memchr(data + pos, '\n', count - pos))) {
+        size_t len = newline + 1 - (data + pos);
+        size_t size = aesd_device->partial_size + len;
+        char *entry_data = aesd_entry_alloc(aesd_device, nbatch, size, inline_max);
+
+        if (!entry_data) {
+            err = -ENOMEM;
+            break;
+        }
+        aesd_partial_linearize(aesd_device, entry_data);
+        aesd_entry_write(entry_data, size - len, data + pos, len);
+        batch[nbatch].buffptr = entry_data;
+        batch[nbatch].size = size;
+        pos += len;
+        if (++nbatch == AESD_WRITE_BATCH) {
+            aesd_add_entries(aesd_device, batch, nbatch);
+            nbatch = 0;
+        }
+    }
+    if (nbatch) {
+        aesd_add_entries(aesd_device, batch, nbatch);
+    }
+
+    if (!err && pos < count) {
+        partial_size = aesd_device->partial_size;
+        err = aesd_partial_append(aesd_device, data + pos, count - pos);
+        if (err) {
+            aesd_partial_truncate(aesd_device, partial_size);
+        }
+    }
+    if (err) {
+        return pos ? pos : err;
+    }
+    return count;
+}
+
+/**
+ * aesd_write_lines() for the @param count bytes of entry storage @param data.  The segments of a
+ * chain are handled in order as if each had been written on its own, which splits lines the
+ * same way.
+ */
+static ssize_t aesd_write_staged(struct aesd_dev *aesd_device, const char *data, size_t count,
+        size_t inline_max)
+{
+    struct aesd_buffer_chain *chain = aesd_buffer_entry_chain(data);
+    size_t done = 0;
+    size_t chunk;
+    ssize_t ret;
+    size_t i;
+
+    if (!chain) {
+        return aesd_write_lines(aesd_device, data, count, inline_max);
+    }
+    for (i = 0; done < count; i++) {
+        chunk = min(count - done, chain->segment_size);
+        ret = aesd_write_lines(aesd_device, chain->segment[i], chunk, inline_max);
+        if (ret < 0) {
+            return done ? done : ret;
+        }
+        done += ret;
+        if (ret < chunk) {
+            break;
+        }
+    }
+    return done;
+}
+
+/**
+ * Fills the @param count bytes of entry storage @param data from @param from
+ * @return the number of bytes copied
+ */
+static size_t aesd_entry_copy_from_iter(char *data, size_t count, struct iov_iter *from)
+{
+    struct aesd_buffer_chain *chain = aesd_buffer_entry_chain(data);
+    size_t done = 0;
+    size_t chunk;
+    size_t i;
+
+    if (!chain) {
+        return copy_from_iter(data, count, from);
+    }
+    for (i = 0; done < count; i++) {
+        chunk = min(count - done, chain->segment_size);
+        if (copy_from_iter(chain->segment[i], chunk, from) != chunk) {
+            break;
+        }
+        done += chunk;
+    }
+    return done;
+}
+
+/**
+ * @return true if the @param count bytes of entry storage @param data are a single line, ending
+ *      in its only newline
+ */
+static bool aesd_entry_is_line(const char *data, size_t count)
+{
+    struct aesd_buffer_chain *chain = aesd_buffer_entry_chain(data);
+    const char *newline;
+    size_t done = 0;
+    size_t chunk;
+    size_t i;
+
+    if (!chain) {
+        return data[count - 1] == '\n' && !memchr(data, '\n', count - 1);
+    }
+    for (i = 0; done < count; i++) {
+        chunk = min(count - done, chain->segment_size);
+        newline = memchr(chain->segment[i], '\n', chunk);
+        if (newline) {
+            return done + (newline - chain->segment[i]) == count - 1;
+        }
+        done += chunk;
+    }
+    return false;
+}
+
+static ssize_t aesd_do_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct aesd_dev *aesd_device = iocb->ki_filp->private_data;
+    size_t count = iov_iter_count(from);
+    size_t inline_max = aesd_inline_limit();
+    ssize_t retval = count;
+    struct aesd_buffer_entry entry;
+    char small[AESD_INLINE_SLOT_SIZE];
+    char *data;
+    int i;
+
+    if (count == 0) {
+        return 0;
+    }
+    // gather all segments into page backed storage before taking the lock, so no user
+    // memory (possibly a mapping of this device) is touched with the mutex held.  Writes
+    // small enough for an inline slot are staged on the stack and need no allocation, large
+    // ones in a page chain.
+    if (count <= inline_max) {
+        data = small;
     } else {
+        data = aesd_entry_alloc(aesd_device, 0, count, 0);
+        if (!data) {
+            return -ENOMEM;
+        }
+    }
+    if (aesd_entry_copy_from_iter(data, count, from) != count) {
+        if (data != small) {
+            aesd_entry_free(aesd_device, data);
+        }
+        return -EFAULT;
     }
-    mutex_lock(aesd_device->mutex);
-    i = mutex_is_locked(aesd_device->mutex);
+
+    // a complete line with no partial entry to finish can skip the mutex and be staged, small
+    // ones in the stage itself
+    if (READ_ONCE(aesd_stage) && !READ_ONCE(aesd_device->partial_size) &&
+            aesd_entry_is_line(data, count) &&
+            aesd_stage_write(aesd_device, data, count, data == small)) {
+        return count;
+    }
+   
+    // lock data, waiting in turn unless the file is non blocking
+    i = aesd_lock(aesd_device, (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT));
     if (i) {
-    } else {
-	return -ENOMEM;
-    }
-
-    if (aesd_device->partial) {
-        for (i = 0; i < aesd_device->partial_entry->size; i++) {
-	    tmp[i] = aesd_device->partial_entry->buffptr[i];
-	}
-	for (i = 0; i < count; i++) {
-       	    tmp[aesd_device->partial_entry->size + i] = data[i];
-	}
-	kfree(data);
-	*data = kmalloc(count+aesd_device->partial_entry->size, GFP_KERNEL);
-	write_size += aesd_device->partial_entry->size;
-	for (i = 0; i < write_size; i++) {
-	    data[i] = tmp[i];
-	}
-    } else {
+        if (data != small) {
+            aesd_entry_free(aesd_device, data);
+        }
+        return i;
     }
- 
-    // check for new line character at the end of the buffer
-    if (data[write_size-1] != '\n') {
-        aesd_device->partial = true;
-        aesd_device->partial_entry->size = write_size;
-        aesd_device->partial_entry->buffptr = data;
-	// entry created is not needed
-	kfree(add_entry);
-    } else {
-  
-        aesd_device->partial = false;	
-        add_entry->size = write_size;
-        add_entry->buffptr = data;
 
-        // add created entry to the buffer
-        aesd_circular_buffer_add_entry(aesd_device->buffer, add_entry);
+    if (list_empty(&aesd_device->partial_frags) && aesd_entry_is_line(data, count)) {
+        // most writes are a single complete line, the copied data becomes the entry payload
+        if (data == small) {
+            data = memcpy(aesd_inline_slot(aesd_device, 0), small, count);
+        }
+        entry.buffptr = data;
+        entry.size = count;
+        aesd_add_entries(aesd_device, &entry, 1);
+    } else {
+        // one record per line, with any unterminated text kept as the partial entry
+        retval = aesd_write_staged(aesd_device, data, count, inline_max);
+        if (data != small) {
+            aesd_entry_free(aesd_device, data);
+        }
     }
     
     // unlock data
-    mutex_unlock(aesd_device->mutex);
-    i = mutex_is_locked(aesd_device->mutex);
-    if (!i) {
-    } else {
-	return -ENOMEM;
+    mutex_unlock(&aesd_device->mutex);
+    return retval;
+}
+
+static ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct aesd_dev *aesd_device = iocb->ki_filp->private_data;
+    u64 start = ktime_get_ns();
+    ssize_t retval;
+
+    trace_aesd_read_enter(MINOR(aesd_device->cdev.dev), iov_iter_count(to), iocb->ki_pos);
+    retval = aesd_do_read_iter(iocb, to);
+    trace_aesd_read_exit(MINOR(aesd_device->cdev.dev), retval, iocb->ki_pos);
+
+    this_cpu_inc(aesd_device->stats->read_latency[aesd_latency_bucket(ktime_get_ns() - start)]);
+    if (retval >= 0) {
+        this_cpu_inc(aesd_device->stats->reads);
+        this_cpu_add(aesd_device->stats->read_bytes, retval);
     }
+    return retval;
+}
 
-    kfree(tmp);
+static ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct aesd_dev *aesd_device = iocb->ki_filp->private_data;
+    u64 start = ktime_get_ns();
+    ssize_t retval;
+
+    trace_aesd_write_enter(MINOR(aesd_device->cdev.dev), iov_iter_count(from), iocb->ki_pos);
+    retval = aesd_do_write_iter(iocb, from);
+    trace_aesd_write_exit(MINOR(aesd_device->cdev.dev), retval, iocb->ki_pos);
 
-    retval = count;
+    this_cpu_inc(aesd_device->stats->write_latency[aesd_latency_bucket(ktime_get_ns() - start)]);
+    if (retval >= 0) {
+        this_cpu_inc(aesd_device->stats->writes);
+        this_cpu_add(aesd_device->stats->write_bytes, retval);
+    }
     return retval;
 }
 
 loff_t aesd_llseek(struct file *filp, loff_t offset, int whence) {
     loff_t newpos;
     struct aesd_dev *aesd_device = filp->private_data;
-    loff_t max_file_size = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED * (1024*30);
-    loff_t total_buffer_size = aesd_device->buffer->total_size;
+    // entries have no size limit of their own, seeks past the end are allowed as for files
+    loff_t max_file_size = MAX_LFS_FILESIZE;
+    loff_t total_buffer_size = aesd_device->buffer.total_size;
     PDEBUG("----SEEK----");
     PDEBUG("whence: %i offset: %lli", whence, offset);
     switch(whence) {
     case SEEK_SET: case SEEK_CUR: case SEEK_END:
         newpos = generic_file_llseek_size(filp, offset, whence, max_file_size, total_buffer_size);
         PDEBUG("newpos: %lli", newpos);
-	return newpos;
+	break;
     default:
-        return -EINVAL;
+        newpos = -EINVAL;
     }
+    trace_aesd_llseek(MINOR(aesd_device->cdev.dev), offset, whence, newpos);
+    return newpos;
 }
 
 static long aesd_adjust_file_offset(struct file *filp, struct aesd_seekto *seekto) {
-    int i;
     struct aesd_dev *aesd_device = filp->private_data;
-    loff_t new_pos = 0;
+    struct aesd_circular_buffer *buffer = &aesd_device->buffer;
+    loff_t new_pos;
+    long retval;
     PDEBUG("Adjusting file offset");
-    
-    for (i = 0; i < seekto->write_cmd; i++) {
-	    new_pos += aesd_device->buffer->entry[i].size;
+
+    retval = aesd_lock(aesd_device, filp->f_flags & O_NONBLOCK);
+    if (retval) {
+        return retval;
     }
-    new_pos += seekto->write_cmd_offset;
+    // write_cmd counts from the oldest entry
+    if (seekto->write_cmd >= aesd_circular_buffer_count(buffer) ||
+            seekto->write_cmd_offset >= aesd_circular_buffer_at(buffer, seekto->write_cmd)->size) {
+        mutex_unlock(&aesd_device->mutex);
+        return -EINVAL;
+    }
+    new_pos = aesd_circular_buffer_offset_of(buffer, seekto->write_cmd) + seekto->write_cmd_offset;
     PDEBUG("New position %lli", new_pos);
-    aesd_device->seekto_position = new_pos;
-    aesd_device->seek = true;
+    // only this open file moves, like lseek
+    filp->f_pos = new_pos;
+    mutex_unlock(&aesd_device->mutex);
+
+    return 0;
+}
+
+static long aesd_get_entries(struct file *filp, struct aesd_entry_table __user *arg)
+{
+    struct aesd_dev *aesd_device = filp->private_data;
+    struct aesd_circular_buffer *buffer = &aesd_device->buffer;
+    struct aesd_entry_table *table;
+    uint32_t i;
+    long retval = 0;
+
+    table = kzalloc(sizeof(*table), GFP_KERNEL);
+    if (!table) {
+        return -ENOMEM;
+    }
+    if (get_user(table->version, &arg->version)) {
+        retval = -EFAULT;
+        goto out;
+    }
+    if (table->version != AESD_ENTRY_TABLE_VERSION) {
+        retval = -EINVAL;
+        goto out;
+    }
+    retval = aesd_lock(aesd_device, filp->f_flags & O_NONBLOCK);
+    if (retval) {
+        goto out;
+    }
+    table->count = aesd_circular_buffer_count(buffer);
+    table->total_size = buffer->total_size;
+    for (i = 0; i < table->count; i++) {
+        table->entry[i].write_cmd = i;
+        table->entry[i].size = aesd_circular_buffer_at(buffer, i)->size;
+        table->entry[i].offset = aesd_circular_buffer_offset_of(buffer, i);
+    }
+    mutex_unlock(&aesd_device->mutex);
+
+    if (copy_to_user(arg, table, sizeof(*table))) {
+        retval = -EFAULT;
+    }
+out:
+    kfree(table);
+    return retval;
+}
+
+static long aesd_get_stats(struct file *filp, struct aesd_stats __user *arg)
+{
+    struct aesd_dev *aesd_device = filp->private_data;
+    struct aesd_stats stats;
+    struct aesd_dev_stats sum;
+    long retval;
+
+    memset(&stats, 0, sizeof(stats));
+    if (get_user(stats.version, &arg->version)) {
+        return -EFAULT;
+    }
+    if (stats.version != AESD_STATS_VERSION) {
+        return -EINVAL;
+    }
+    retval = aesd_lock(aesd_device, filp->f_flags & O_NONBLOCK);
+    if (retval) {
+        return retval;
+    }
+    stats.entries = aesd_circular_buffer_count(&aesd_device->buffer);
+    stats.total_size = aesd_device->buffer.total_size;
+    stats.partial_size = aesd_device->partial_size;
+    mutex_unlock(&aesd_device->mutex);
+
+    aesd_stats_sum(aesd_device, &sum);
+    stats.writes = sum.writes;
+    stats.write_bytes = sum.write_bytes;
+    stats.reads = sum.reads;
+    stats.read_bytes = sum.read_bytes;
+    stats.evictions = sum.evictions;
+    stats.lock_contended = sum.lock_contended;
 
+    if (copy_to_user(arg, &stats, sizeof(stats))) {
+        return -EFAULT;
+    }
     return 0;
 }
 
-static long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+static long aesd_do_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
     long retval;
     // check for invalid commands
     PDEBUG("----IOCTL----");
@@ -295,6 +1058,10 @@ static long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
 	    retval = aesd_adjust_file_offset(filp, &seekto); 
 	    //kfree(seekto);
 	    return retval;
+	case AESDCHAR_IOCGENTRIES:
+	    return aesd_get_entries(filp, (struct aesd_entry_table __user *)arg);
+	case AESDCHAR_IOCGSTATS:
+	    return aesd_get_stats(filp, (struct aesd_stats __user *)arg);
 	default:
             /* redundant, as cmd was checked against MAXNR */
 	    return -ENOTTY;
@@ -302,111 +1069,353 @@ static long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
     return 0;
 }
 
+static long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct aesd_dev *aesd_device = filp->private_data;
+    long retval = aesd_do_ioctl(filp, cmd, arg);
+
+    trace_aesd_ioctl(MINOR(aesd_device->cdev.dev), cmd, retval);
+    return retval;
+}
+
+/**
+ * The device is always writable.  It is readable once data exists past the file position,
+ * so an epoll set wakes up for new entries rather than for the end of data.
+ */
+static __poll_t aesd_poll(struct file *filp, poll_table *wait)
+{
+    struct aesd_dev *aesd_device = filp->private_data;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+    poll_wait(filp, &aesd_device->read_queue, wait);
+
+    mutex_lock(&aesd_device->mutex);
+    aesd_stage_merge(aesd_device);
+    if (filp->f_pos < aesd_device->buffer.total_size) {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    mutex_unlock(&aesd_device->mutex);
+    return mask;
+}
+
+/**
+ * @return the page at @param pgoff of the mapping, or NULL past its end.  Must be called inside
+ *      aesd_mmap_srcu, which keeps payload pages from being freed until the caller leaves it.
+ */
+static struct page *aesd_mmap_find_page(struct aesd_dev *dev, pgoff_t pgoff)
+{
+    uint64_t offset = (uint64_t)pgoff << PAGE_SHIFT;
+    struct aesd_mmap_range *range;
+    struct page *page = NULL;
+    unsigned int i;
+
+    if (pgoff == 0) {
+        return virt_to_page(dev->mmap_header);
+    }
+    if (offset < PAGE_SIZE + PAGE_ALIGN(AESD_INLINE_ARENA_SIZE)) {
+        return virt_to_page(dev->inline_arena + (offset - PAGE_SIZE));
+    }
+    spin_lock(&dev->mmap_ranges_lock);
+    for (i = 0; i < dev->mmap_nranges; i++) {
+        range = &dev->mmap_ranges[i];
+        if (offset >= range->mmap_offset && offset < range->mmap_offset + PAGE_ALIGN(range->size)) {
+            struct aesd_buffer_chain *chain = aesd_buffer_entry_chain(range->buffptr);
+
+            offset -= range->mmap_offset;
+            if (chain) {
+                page = virt_to_page(chain->segment[offset >> PAGE_SHIFT]);
+            } else {
+                page = virt_to_page(range->buffptr + offset);
+            }
+            break;
+        }
+    }
+    spin_unlock(&dev->mmap_ranges_lock);
+    return page;
+}
+
+/*
+ * Runs under mmap_lock, so it must not take the device mutex, which readers hold while copying
+ * to user memory.  The page is inserted here rather than returned in vmf->page so that it is
+ * mapped before aesd_mmap_update stops waiting for this fault.
+ */
+static vm_fault_t aesd_vm_fault(struct vm_fault *vmf)
+{
+    struct aesd_dev *dev = vmf->vma->vm_private_data;
+    vm_fault_t ret = VM_FAULT_SIGBUS;
+    struct page *page;
+    int idx;
+    int err;
+
+    idx = srcu_read_lock(&aesd_mmap_srcu);
+    page = aesd_mmap_find_page(dev, vmf->pgoff);
+    if (page) {
+        // the mapping keeps its own reference, the payload may be evicted while mapped
+        err = vm_insert_page(vmf->vma, vmf->address, page);
+        // -EBUSY is another thread faulting the same page in first
+        ret = (err && err != -EBUSY) ? vmf_error(err) : VM_FAULT_NOPAGE;
+    }
+    srcu_read_unlock(&aesd_mmap_srcu, idx);
+    return ret;
+}
+
+static const struct vm_operations_struct aesd_vm_ops = {
+    .fault = aesd_vm_fault,
+};
+
+static int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct aesd_dev *aesd_device = filp->private_data;
+
+    // the mapping is a read only view of the ring
+    if (vma->vm_flags & VM_WRITE) {
+        return -EPERM;
+    }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP | VM_MIXEDMAP);
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP | VM_MIXEDMAP;
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+    vma->vm_ops = &aesd_vm_ops;
+    vma->vm_private_data = aesd_device;
+    return 0;
+}
+
+static int aesd_stats_show(struct seq_file *s, void *unused)
+{
+    struct aesd_payload_stats stats;
+
+    aesd_payload_get_stats(&stats);
+    seq_printf(s, "payload_page_allocs %llu\n", stats.page_allocs);
+    seq_printf(s, "payload_pool_hits %llu\n", stats.pool_hits);
+    seq_printf(s, "payload_pool_recycles %llu\n", stats.pool_recycles);
+    seq_printf(s, "payload_page_frees %llu\n", stats.page_frees);
+    seq_printf(s, "fragment_allocs %llu\n", stats.fragment_allocs);
+    seq_printf(s, "chain_allocs %llu\n", stats.chain_allocs);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(aesd_stats);
+
+static void aesd_latency_show(struct seq_file *s, const char *name, const u64 *histogram)
+{
+    unsigned int i;
+
+    for (i = 0; i < AESD_LATENCY_BUCKETS; i++) {
+        if (histogram[i]) {
+            seq_printf(s, "%s_lt_%lluns %llu\n", name, 1ULL << i, histogram[i]);
+        }
+    }
+}
+
+static int aesd_dev_stats_show(struct seq_file *s, void *unused)
+{
+    struct aesd_dev *dev = s->private;
+    struct aesd_dev_stats stats;
+
+    aesd_stats_sum(dev, &stats);
+    seq_printf(s, "reads %llu\n", stats.reads);
+    seq_printf(s, "read_bytes %llu\n", stats.read_bytes);
+    seq_printf(s, "writes %llu\n", stats.writes);
+    seq_printf(s, "write_bytes %llu\n", stats.write_bytes);
+    seq_printf(s, "evictions %llu\n", stats.evictions);
+    seq_printf(s, "inline_entries %llu\n", stats.inline_entries);
+    seq_printf(s, "staged_entries %llu\n", stats.staged_entries);
+    seq_printf(s, "lock_contended %llu\n", stats.lock_contended);
+    seq_printf(s, "lock_wait_ns %llu\n", stats.lock_wait_ns);
+    aesd_latency_show(s, "read_latency", stats.read_latency);
+    aesd_latency_show(s, "write_latency", stats.write_latency);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(aesd_dev_stats);
+
 struct file_operations aesd_fops = {
     .owner =    THIS_MODULE,
-    .read =     aesd_read,
-    .write =    aesd_write,
+    .read_iter = aesd_read_iter,
+    .write_iter = aesd_write_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read = copy_splice_read,
+#else
+    .splice_read = generic_file_splice_read,
+#endif
     .open =     aesd_open,
     .release =  aesd_release,
     .llseek =   aesd_llseek,
     .unlocked_ioctl = aesd_ioctl,
+    .mmap =     aesd_mmap,
+    .poll =     aesd_poll,
 };
 
-static int aesd_setup_cdev(struct aesd_dev *dev)
+static int aesd_setup_cdev(struct aesd_dev *dev, int index)
 {
-    int err, devno = MKDEV(aesd_major, aesd_minor);
+    int err, devno = MKDEV(aesd_major, aesd_minor + index);
 
     cdev_init(&dev->cdev, &aesd_fops);
     dev->cdev.owner = THIS_MODULE;
     dev->cdev.ops = &aesd_fops;
     err = cdev_add (&dev->cdev, devno, 1);
     if (err) {
-        printk(KERN_ERR "Error %d adding aesd cdev", err);
+        printk(KERN_ERR "Error %d adding aesd cdev %d", err, index);
     }
     return err;
 }
 
+static int aesd_dev_init(struct aesd_dev *dev)
+{
+    int cpu;
 
+    INIT_DELAYED_WORK(&dev->stage_work, aesd_stage_work);
+    dev->stats = alloc_percpu(struct aesd_dev_stats);
+    if (!dev->stats) {
+        return -ENOMEM;
+    }
+    dev->stage = alloc_percpu(struct aesd_stage);
+    if (!dev->stage) {
+        return -ENOMEM;
+    }
+    for_each_possible_cpu(cpu) {
+        spin_lock_init(&per_cpu_ptr(dev->stage, cpu)->lock);
+    }
+    atomic64_set(&dev->stage_seq, 0);
+    dev->stage_merged = 0;
+    mutex_init(&dev->mutex);
+    init_waitqueue_head(&dev->read_queue);
+    address_space_init_once(&dev->mmap_mapping);
+    spin_lock_init(&dev->mmap_ranges_lock);
+    aesd_circular_buffer_init(&dev->buffer);
+    INIT_LIST_HEAD(&dev->partial_frags);
+    dev->partial_size = 0;
+
+    BUILD_BUG_ON(sizeof(struct aesd_mmap_header) > PAGE_SIZE);
+    dev->mmap_header = (struct aesd_mmap_header *)get_zeroed_page(GFP_KERNEL);
+    if (!dev->mmap_header) {
+        return -ENOMEM;
+    }
+    // slots are picked with the head counter, which wraps at the width of its type
+    BUILD_BUG_ON(AESD_INLINE_SLOTS > 1ULL << (8 * sizeof(dev->buffer.head)));
+    // compound, so the fault handler can take references on any page of it
+    dev->inline_arena = (char *)__get_free_pages(GFP_KERNEL | __GFP_ZERO | __GFP_COMP,
+            get_order(AESD_INLINE_ARENA_SIZE));
+    if (!dev->inline_arena) {
+        return -ENOMEM;
+    }
+    dev->mmap_header->magic = AESD_MMAP_MAGIC;
+    dev->mmap_header->version = AESD_MMAP_VERSION;
+    aesd_mmap_update(dev, false);
+    return 0;
+}
+
+static void aesd_dev_destroy(struct aesd_dev *dev)
+{
+    unsigned int i;
+
+    if (dev->stage) {
+        cancel_delayed_work_sync(&dev->stage_work);
+        if (dev->inline_arena) {
+            aesd_stage_merge(dev);
+        }
+        free_percpu(dev->stage);
+    }
+    for (i = 0; i < aesd_circular_buffer_count(&dev->buffer); i++) {
+        aesd_entry_free(dev, aesd_circular_buffer_at(&dev->buffer, i)->buffptr);
+    }
+    aesd_partial_truncate(dev, 0);
+    if (dev->inline_arena) {
+        free_pages((unsigned long)dev->inline_arena, get_order(AESD_INLINE_ARENA_SIZE));
+    }
+    free_page((unsigned long)dev->mmap_header);
+    free_percpu(dev->stats);
+    mutex_destroy(&dev->mutex);
+}
+
+void aesd_cleanup_module(void)
+{
+    dev_t devno = MKDEV(aesd_major, aesd_minor);
+    int i;
+
+    debugfs_remove_recursive(aesd_debugfs_dir);
+    if (aesd_devices) {
+        for (i = 0; i < aesd_nr_devs && aesd_devices[i]; i++) {
+            if (aesd_devices[i]->cdev.ops) {
+                cdev_del(&aesd_devices[i]->cdev);
+            }
+            aesd_dev_destroy(aesd_devices[i]);
+            kmem_cache_free(aesd_dev_cache, aesd_devices[i]);
+        }
+        kfree(aesd_devices);
+    }
+    kmem_cache_destroy(aesd_dev_cache);
+    aesd_payload_pool_destroy();
+
+    unregister_chrdev_region(devno, aesd_nr_devs);
+}
 
 int aesd_init_module(void)
 {
     dev_t dev = 0;
     int result;
-    uint i;
-    struct mutex *aesd_mutex = kmalloc(sizeof(struct mutex), GFP_KERNEL);
-    struct aesd_circular_buffer *aesd_buffer = kmalloc(sizeof(struct aesd_circular_buffer),GFP_KERNEL);
-    struct aesd_buffer_entry *aesd_partial_entry = kmalloc(sizeof(struct aesd_buffer_entry),GFP_KERNEL);
+    int i;
 
-    PDEBUG("Initialize device");
+    PDEBUG("Initialize %d devices", aesd_nr_devs);
 
-    result = alloc_chrdev_region(&dev, aesd_minor, 1,
+    if (aesd_nr_devs < 1) {
+        return -EINVAL;
+    }
+    result = aesd_payload_pool_init();
+    if (result) {
+        return result;
+    }
+
+    result = alloc_chrdev_region(&dev, aesd_minor, aesd_nr_devs,
             "aesdchar");
     aesd_major = MAJOR(dev);
     if (result < 0) {
         printk(KERN_WARNING "Can't get major %d\n", aesd_major);
+        aesd_payload_pool_destroy();
         return result;
     }
-    memset(&aesd_device,0,sizeof(struct aesd_dev));
 
     /**
-     * TODO: initialize the AESD specific portion of the device
+     * Each device is a separate shard with its own ring, lock and counters.  struct aesd_dev
+     * is cache line aligned, and comes from its own cache so that kmalloc alignment does not
+     * undo that, so writers on different devices do not share cache lines.
      */
-    // init locking primitive
-    
-    mutex_init(aesd_mutex);
-    aesd_circular_buffer_init(aesd_buffer);
-
-    aesd_device.mutex = aesd_mutex;
-    aesd_device.buffer = aesd_buffer;
-    aesd_device.partial_entry = aesd_partial_entry;
-    aesd_device.partial_entry->size = 0;
-    aesd_device.partial = false;
-    aesd_device.seekto_position = 0;
-    aesd_device.seek = false;
-
-    aesd_device.buffer->full = false;
-    aesd_device.buffer->in_offs = 0;
-    aesd_device.buffer->out_offs = 0;
-    aesd_device.buffer->total_size = 0;
-
-
-    for(i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
-	struct aesd_buffer_entry *add_entry = kmalloc(sizeof(*add_entry),GFP_KERNEL);
-        aesd_device.buffer->entry[i] = *add_entry;
+    aesd_dev_cache = KMEM_CACHE(aesd_dev, SLAB_HWCACHE_ALIGN);
+    aesd_devices = kcalloc(aesd_nr_devs, sizeof(*aesd_devices), GFP_KERNEL);
+    if (!aesd_dev_cache || !aesd_devices) {
+        result = -ENOMEM;
+        goto fail;
     }
-    result = aesd_setup_cdev(&aesd_device);
-
-    if( result ) {
-        unregister_chrdev_region(dev, 1);
+    for (i = 0; i < aesd_nr_devs; i++) {
+        aesd_devices[i] = kmem_cache_zalloc(aesd_dev_cache, GFP_KERNEL);
+        if (!aesd_devices[i]) {
+            result = -ENOMEM;
+            goto fail;
+        }
+        result = aesd_dev_init(aesd_devices[i]);
+        if (result) {
+            goto fail;
+        }
+        result = aesd_setup_cdev(aesd_devices[i], i);
+        if (result) {
+            goto fail;
+        }
     }
-    return result;
-
-}
 
-void aesd_cleanup_module(void)
-{
-    dev_t devno;
-    size_t index;
-    //struct aesd_circular_buffer buffer = aesd_device.buffer;
-    struct aesd_buffer_entry *entry;
-    
-    
-    devno = MKDEV(aesd_major, aesd_minor);
-    cdev_del(&aesd_device.cdev);
-    mutex_destroy(aesd_device.mutex);
+    aesd_debugfs_dir = debugfs_create_dir("aesdchar", NULL);
+    debugfs_create_file("stats", S_IRUGO, aesd_debugfs_dir, NULL, &aesd_stats_fops);
+    for (i = 0; i < aesd_nr_devs; i++) {
+        char name[16];
 
-    /**
-     * TODO: cleanup AESD specific poritions here as necessary
-     */
-    AESD_CIRCULAR_BUFFER_FOREACH(entry, aesd_device.buffer, index) {
-	if (index < aesd_device.buffer->in_offs) {
-	    kfree(entry->buffptr);
-	}
+        snprintf(name, sizeof(name), "aesdchar%d", i);
+        debugfs_create_file(name, S_IRUGO, aesd_debugfs_dir, aesd_devices[i], &aesd_dev_stats_fops);
     }
-    kfree(aesd_device.buffer);
-    kfree(aesd_device.partial_entry);
+    return 0;
 
-    unregister_chrdev_region(devno, 1);
+fail:
+    aesd_cleanup_module();
+    return result;
 }
 
 
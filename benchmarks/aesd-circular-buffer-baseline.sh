@@ -0,0 +1,52 @@
+#!/bin/bash
+# Records benchmarks/aesd-circular-buffer-baseline.csv for this host.
+#
+# Usage: aesd-circular-buffer-baseline.sh [build dir] [runs]
+#     defaults to the build directory and 5 runs of every aesd-circular-buffer-bench binary.
+# Speed differs between processes as well as within one, so every row of the baseline is the
+# median over the runs, with noise_pct widened to the spread of relative between the runs.
+# The "bench" target allows that spread on top of its threshold.  Commit a refreshed baseline
+# on its own, not together with the change it measures.
+
+set -e
+set -u
+
+BUILD_DIR=${1:-build}
+RUNS=${2:-5}
+REPO_DIR=$(realpath $(dirname $0)/..)
+
+for bench in ${BUILD_DIR}/aesd-circular-buffer-bench-*; do
+    for run in $(seq 1 ${RUNS}); do
+        ${bench} --no-header
+    done
+done | awk -F, -v OFS=, '
+    {
+        key = $1 FS $2 FS $3
+        if (!(key in n)) {
+            order[++nkeys] = key
+        }
+        k = ++n[key]
+        row[key, k] = $0
+        rel[key, k] = $7
+        if (k == 1 || $8 > noise[key]) {
+            noise[key] = $8
+        }
+    }
+    END {
+        print "benchmark,capacity,entry_size,iterations,ns_per_op,bytes_per_sec,relative,noise_pct"
+        for (i = 1; i <= nkeys; i++) {
+            key = order[i]
+            # insertion sort of the runs by relative
+            for (a = 2; a <= n[key]; a++) {
+                for (b = a; b > 1 && rel[key, b - 1] > rel[key, b]; b--) {
+                    t = rel[key, b]; rel[key, b] = rel[key, b - 1]; rel[key, b - 1] = t
+                    t = row[key, b]; row[key, b] = row[key, b - 1]; row[key, b - 1] = t
+                }
+            }
+            mid = int((n[key] + 1) / 2)
+            spread = (rel[key, n[key]] - rel[key, 1]) / rel[key, mid] * 100
+            split(row[key, mid], f, FS)
+            printf "%s,%s,%s,%s,%s,%s,%s,%.1f\n", f[1], f[2], f[3], f[4], f[5], f[6], f[7], \
+                (spread > noise[key] ? spread : noise[key])
+        }
+    }' > ${REPO_DIR}/benchmarks/aesd-circular-buffer-baseline.csv
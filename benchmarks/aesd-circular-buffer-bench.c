@@ -0,0 +1,456 @@
+/**
+ * @file aesd-circular-buffer-bench.c
+ * @brief Userspace microbenchmark for the aesd-char-driver circular buffer
+ *
+ * Times aesd_circular_buffer_add_entry, aesd_circular_buffer_add_entries in batches of
+ * BENCH_BATCH, aesd_circular_buffer_find_entry_offset_for_fpos, aesd_circular_buffer_read_helper
+ * and a full copy through struct aesd_circular_buffer_iter over a sweep of entry sizes.  The
+ * capacity is fixed when the buffer is compiled, so CMake builds one binary per capacity, see
+ * CMakeLists.txt.
+ *
+ * Results are printed as csv on stdout:
+ *     benchmark,capacity,entry_size,iterations,ns_per_op,bytes_per_sec,relative,noise_pct
+ * ns_per_op depends on the host, so every benchmark is timed together with a reference run
+ * in the same process: a fixed chain of multiplies for the benchmarks which only touch the
+ * ring, a memcpy of the same bytes for the ones which copy.  relative is ns_per_op over the
+ * reference, which carries over between hosts and clock speeds far better.  noise_pct is the
+ * spread of that ratio over the repeats of the run.
+ *
+ * With --baseline, each relative is compared against the row of a previous run with the same
+ * benchmark, capacity and entry_size, and the program exits with status 1 when any of them is
+ * more than --threshold percent, plus the noise_pct of both rows, higher in the run and in
+ * BENCH_RETRIES fresh measurements of that row.  benchmarks/aesd-circular-buffer-baseline.sh
+ * records the baseline over several runs of every binary; refresh it after an intended change,
+ * in a commit of its own.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "aesd-circular-buffer.h"
+
+#define BENCH_REPEATS 9
+#define BENCH_MIN_NS 10000000ULL
+#define BENCH_FPOS_SAMPLES 1024
+#define BENCH_BATCH 8
+#define BENCH_REF_CHAIN 64
+#define BENCH_RETRIES 2
+#define DEFAULT_THRESHOLD_PCT 30.0
+
+static const size_t entry_sizes[] = { 16, 256, 4096, 65536 };
+
+struct result {
+    const char *benchmark;
+    size_t entry_size;
+    uint64_t iterations;
+    double ns_per_op;
+    double bytes_per_sec;
+    /* ns_per_op over the ns_per_op of the reference */
+    double relative;
+    /* Interquartile range of relative over the repeats, in percent of relative */
+    double noise_pct;
+};
+
+/* Keeps the compiler from discarding the results of the timed calls */
+static volatile size_t sink;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void fill_buffer(struct aesd_circular_buffer *buffer, const char *payload, size_t entry_size)
+{
+    struct aesd_buffer_entry entry = { .buffptr = payload, .size = entry_size };
+    int i;
+
+    aesd_circular_buffer_init(buffer);
+    // exactly one lap, so out_offs is back at 0 and read_helper can walk the ring in one call
+    for (i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
+        aesd_circular_buffer_add_entry(buffer, &entry);
+    }
+}
+
+static uint64_t run_add_entry(struct aesd_circular_buffer *buffer, const char *payload,
+    size_t entry_size, uint64_t iterations)
+{
+    struct aesd_buffer_entry entry = { .buffptr = payload, .size = entry_size };
+    uint64_t start;
+    uint64_t i;
+
+    fill_buffer(buffer, payload, entry_size);
+    start = now_ns();
+    for (i = 0; i < iterations; i++) {
+        sink += (size_t)aesd_circular_buffer_add_entry(buffer, &entry);
+    }
+    return now_ns() - start;
+}
+
+static uint64_t run_add_entries(struct aesd_circular_buffer *buffer, const char *payload,
+    size_t entry_size, uint64_t iterations)
+{
+    struct aesd_buffer_entry entries[BENCH_BATCH];
+    const char *evicted[BENCH_BATCH];
+    uint64_t start;
+    uint64_t i;
+
+    for (i = 0; i < BENCH_BATCH; i++) {
+        entries[i].buffptr = payload;
+        entries[i].size = entry_size;
+    }
+    fill_buffer(buffer, payload, entry_size);
+    start = now_ns();
+    for (i = 0; i < iterations; i++) {
+        sink += aesd_circular_buffer_add_entries(buffer, entries, BENCH_BATCH, evicted);
+    }
+    return now_ns() - start;
+}
+
+static uint64_t run_find_entry(struct aesd_circular_buffer *buffer, const char *payload,
+    size_t entry_size, uint64_t iterations)
+{
+    size_t offsets[BENCH_FPOS_SAMPLES];
+    size_t total = entry_size * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    size_t entry_offset;
+    uint32_t seed = 2463534242u;
+    uint64_t start;
+    uint64_t i;
+
+    fill_buffer(buffer, payload, entry_size);
+    // spread lookups over the whole buffer so the scan length is not the same every call
+    for (i = 0; i < BENCH_FPOS_SAMPLES; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        offsets[i] = seed % total;
+    }
+    start = now_ns();
+    for (i = 0; i < iterations; i++) {
+        sink += (size_t)aesd_circular_buffer_find_entry_offset_for_fpos(buffer,
+            offsets[i % BENCH_FPOS_SAMPLES], &entry_offset);
+    }
+    return now_ns() - start;
+}
+
+static char *read_dest;
+
+static uint64_t run_read_helper(struct aesd_circular_buffer *buffer, const char *payload,
+    size_t entry_size, uint64_t iterations)
+{
+    size_t total = entry_size * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    size_t byte_offset;
+    uint64_t start;
+    uint64_t i;
+
+    fill_buffer(buffer, payload, entry_size);
+    start = now_ns();
+    for (i = 0; i < iterations; i++) {
+        byte_offset = 0;
+        sink += aesd_circular_buffer_read_helper(buffer, 0, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED,
+            read_dest, total, &byte_offset);
+    }
+    return now_ns() - start;
+}
+
+static uint64_t run_iter_copy(struct aesd_circular_buffer *buffer, const char *payload,
+    size_t entry_size, uint64_t iterations)
+{
+    size_t total = entry_size * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    struct aesd_circular_buffer_iter iter;
+    const char *data;
+    size_t len;
+    size_t copied;
+    uint64_t start;
+    uint64_t i;
+
+    fill_buffer(buffer, payload, entry_size);
+    start = now_ns();
+    for (i = 0; i < iterations; i++) {
+        copied = 0;
+        aesd_circular_buffer_iter_init(&iter, buffer, 0, total);
+        while (aesd_circular_buffer_iter_next(&iter, &data, &len)) {
+            memcpy(read_dest + copied, data, len);
+            copied += len;
+        }
+        sink += copied;
+    }
+    return now_ns() - start;
+}
+
+/* Source of run_ref_copy, as large as the whole buffer at the largest entry size */
+static char *copy_src;
+
+/**
+ * Reference for the benchmarks which only touch the ring: a dependent chain of
+ * BENCH_REF_CHAIN multiplies per iteration, which runs at the speed of the core alone
+ */
+static uint64_t run_ref_chain(struct aesd_circular_buffer *buffer, const char *payload,
+    size_t entry_size, uint64_t iterations)
+{
+    uint64_t x = entry_size;
+    uint64_t start;
+    uint64_t i;
+    int k;
+
+    (void)buffer;
+    (void)payload;
+    start = now_ns();
+    for (i = 0; i < iterations; i++) {
+        for (k = 0; k < BENCH_REF_CHAIN; k++) {
+            x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        }
+        sink += x;
+    }
+    return now_ns() - start;
+}
+
+/**
+ * Reference for read_helper and iter_copy: one memcpy of the bytes they copy per iteration
+ */
+static uint64_t run_ref_copy(struct aesd_circular_buffer *buffer, const char *payload,
+    size_t entry_size, uint64_t iterations)
+{
+    size_t total = entry_size * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    uint64_t start;
+    uint64_t i;
+
+    (void)buffer;
+    (void)payload;
+    start = now_ns();
+    for (i = 0; i < iterations; i++) {
+        memcpy(read_dest, copy_src, total);
+        sink += read_dest[i % total];
+    }
+    return now_ns() - start;
+}
+
+typedef uint64_t (*bench_fn)(struct aesd_circular_buffer *, const char *, size_t, uint64_t);
+
+struct benchmark {
+    const char *name;
+    bench_fn fn;
+    /* What fn is timed against, run_ref_chain or run_ref_copy */
+    bench_fn ref;
+    /* Payload moved by one call, in entry sizes */
+    size_t entries_per_op;
+};
+
+static const struct benchmark benchmarks[] = {
+    { "add_entry", run_add_entry, run_ref_chain, 1 },
+    { "add_entries_x8", run_add_entries, run_ref_chain, BENCH_BATCH },
+    { "find_entry_offset_for_fpos", run_find_entry, run_ref_chain, 1 },
+    { "read_helper", run_read_helper, run_ref_copy, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED },
+    { "iter_copy", run_iter_copy, run_ref_copy, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED },
+};
+
+#define NBENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @return an iteration count for which one run of @param fn takes at least BENCH_MIN_NS
+ */
+static uint64_t calibrate(bench_fn fn, struct aesd_circular_buffer *buffer, const char *payload,
+    size_t entry_size)
+{
+    uint64_t iterations = 1;
+    uint64_t elapsed;
+
+    // first run faults in the destination pages and warms the caches
+    fn(buffer, payload, entry_size, 1);
+    while ((elapsed = fn(buffer, payload, entry_size, iterations)) < BENCH_MIN_NS) {
+        iterations *= elapsed ? (BENCH_MIN_NS / elapsed) + 1 : 10;
+    }
+    return iterations;
+}
+
+/**
+ * Runs benchmark @param b and its reference in turn BENCH_REPEATS times, each run at least
+ * BENCH_MIN_NS long.  ns_per_op is from the fastest run, relative is the median of the ratios
+ * of the pairs of runs, so a slow patch of the host hits both sides of a ratio, and noise_pct
+ * is the spread of the middle half of those ratios.
+ */
+static struct result measure(const struct benchmark *b, struct aesd_circular_buffer *buffer,
+    const char *payload, size_t entry_size)
+{
+    struct result r = { .benchmark = b->name, .entry_size = entry_size };
+    bench_fn fn = b->fn, ref = b->ref;
+    double ratios[BENCH_REPEATS];
+    uint64_t ref_iterations;
+    uint64_t best = UINT64_MAX;
+    uint64_t elapsed;
+    int i;
+
+    r.iterations = calibrate(fn, buffer, payload, entry_size);
+    ref_iterations = calibrate(ref, buffer, payload, entry_size);
+    for (i = 0; i < BENCH_REPEATS; i++) {
+        elapsed = fn(buffer, payload, entry_size, r.iterations);
+        if (elapsed < best) {
+            best = elapsed;
+        }
+        ratios[i] = (double)elapsed / r.iterations;
+        elapsed = ref(buffer, payload, entry_size, ref_iterations);
+        ratios[i] /= (double)elapsed / ref_iterations;
+    }
+    qsort(ratios, BENCH_REPEATS, sizeof(ratios[0]), compare_double);
+    r.ns_per_op = (double)best / r.iterations;
+    r.bytes_per_sec = entry_size * b->entries_per_op * 1e9 / r.ns_per_op;
+    r.relative = ratios[BENCH_REPEATS / 2];
+    r.noise_pct = (ratios[BENCH_REPEATS * 3 / 4] - ratios[BENCH_REPEATS / 4]) / r.relative * 100;
+    return r;
+}
+
+/**
+ * @return the relative cost recorded in @param baseline for the given row, with its noise in
+ * @param noise_pct, or a negative value if the file has no such row.  Lines starting with #
+ * and header lines are ignored.
+ */
+static double baseline_lookup(FILE *baseline, const char *benchmark, size_t entry_size,
+    double *noise_pct)
+{
+    char line[256];
+    char name[64];
+    unsigned capacity;
+    size_t size;
+    unsigned long long iterations;
+    double ns_per_op;
+    double bytes_per_sec;
+    double relative;
+
+    rewind(baseline);
+    while (fgets(line, sizeof(line), baseline)) {
+        if (line[0] == '#') {
+            continue;
+        }
+        if (sscanf(line, "%63[^,],%u,%zu,%llu,%lf,%lf,%lf,%lf", name, &capacity, &size,
+                &iterations, &ns_per_op, &bytes_per_sec, &relative, noise_pct) != 8) {
+            continue;
+        }
+        if (strcmp(name, benchmark) == 0 && capacity == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED &&
+                size == entry_size) {
+            return relative;
+        }
+    }
+    return -1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [--baseline <file>] [--threshold <percent>] [--no-header]\n", prog);
+}
+
+/**
+ * @return true if @param r is more than @param threshold percent, plus its own noise and the
+ * noise @param base_noise_pct of the baseline, above the relative cost @param base
+ */
+static bool is_regression(const struct result *r, double base, double base_noise_pct,
+    double threshold)
+{
+    return base > 0 && r->relative > base * (1 + (threshold + r->noise_pct + base_noise_pct) / 100);
+}
+
+int main(int argc, char *argv[])
+{
+    struct aesd_circular_buffer buffer;
+    struct result results[NBENCHMARKS * sizeof(entry_sizes) / sizeof(entry_sizes[0])];
+    struct result retry;
+    const char *baseline_path = NULL;
+    double threshold = DEFAULT_THRESHOLD_PCT;
+    bool header = true;
+    bool regressed = false;
+    size_t max_size = 0;
+    size_t nresults = 0;
+    char *payload;
+    FILE *baseline = NULL;
+    double base, base_noise;
+    size_t i, j;
+    int k;
+
+    for (i = 1; i < (size_t)argc; i++) {
+        if (strcmp(argv[i], "--baseline") == 0 && i + 1 < (size_t)argc) {
+            baseline_path = argv[++i];
+        } else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < (size_t)argc) {
+            threshold = strtod(argv[++i], NULL);
+        } else if (strcmp(argv[i], "--no-header") == 0) {
+            header = false;
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (baseline_path) {
+        baseline = fopen(baseline_path, "r");
+        if (!baseline) {
+            fprintf(stderr, "Unable to open baseline %s: %s\n", baseline_path, strerror(errno));
+            return 2;
+        }
+    }
+
+    for (i = 0; i < sizeof(entry_sizes) / sizeof(entry_sizes[0]); i++) {
+        if (entry_sizes[i] > max_size) {
+            max_size = entry_sizes[i];
+        }
+    }
+    payload = malloc(max_size);
+    read_dest = malloc(max_size * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+    copy_src = malloc(max_size * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+    if (!payload || !read_dest || !copy_src) {
+        fprintf(stderr, "Out of memory\n");
+        return 2;
+    }
+    memset(payload, 'a', max_size);
+    memset(copy_src, 'a', max_size * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+
+    for (i = 0; i < sizeof(entry_sizes) / sizeof(entry_sizes[0]); i++) {
+        for (j = 0; j < NBENCHMARKS; j++) {
+            results[nresults++] = measure(&benchmarks[j], &buffer, payload, entry_sizes[i]);
+        }
+    }
+
+    if (header) {
+        printf("benchmark,capacity,entry_size,iterations,ns_per_op,bytes_per_sec,relative,noise_pct\n");
+    }
+    for (i = 0; i < nresults; i++) {
+        struct result *r = &results[i];
+        printf("%s,%d,%zu,%llu,%.3f,%.0f,%.4f,%.1f\n", r->benchmark,
+            AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, r->entry_size,
+            (unsigned long long)r->iterations, r->ns_per_op, r->bytes_per_sec, r->relative,
+            r->noise_pct);
+        if (!baseline) {
+            continue;
+        }
+        // a noisy run widens its own margin, and a regression only counts if every retry agrees
+        base = baseline_lookup(baseline, r->benchmark, r->entry_size, &base_noise);
+        retry = *r;
+        for (k = 0; k < BENCH_RETRIES && is_regression(&retry, base, base_noise, threshold); k++) {
+            retry = measure(&benchmarks[i % NBENCHMARKS], &buffer, payload, r->entry_size);
+        }
+        if (is_regression(&retry, base, base_noise, threshold)) {
+            fprintf(stderr, "REGRESSION %s capacity %d entry_size %zu: %.4f x reference, baseline %.4f (+%.1f%%, noise %.1f%%)\n",
+                r->benchmark, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, r->entry_size,
+                retry.relative, base, (retry.relative / base - 1) * 100, retry.noise_pct);
+            regressed = true;
+        }
+    }
+
+    if (baseline) {
+        fclose(baseline);
+    }
+    free(payload);
+    free(read_dest);
+    free(copy_src);
+    return regressed ? 1 : 0;
+}
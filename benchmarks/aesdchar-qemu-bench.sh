@@ -0,0 +1,91 @@
+#!/bin/bash
+# Boots the QEMU image built by finder-app/manual-linux.sh, loads aesdchar.ko with aesdchar_load
+# and runs benchmarks/aesdchar-stress against it.  Needs no network and no KVM.
+#
+# Usage: aesdchar-qemu-bench.sh [outdir] [aesdchar-stress arguments...]
+#     outdir defaults to /tmp/aeld, as for manual-linux.sh
+# Environment:
+#     SMP          number of emulated cpus, default 4
+#     MODULE_ARGS  parameters for insmod, for instance "aesd_stage=1 aesd_nr_devs=2"
+# The csv printed by aesdchar-stress is saved to ${OUTDIR}/aesdchar-bench.csv and the whole
+# console output to ${OUTDIR}/aesdchar-bench.log.
+
+set -e
+set -u
+
+OUTDIR=/tmp/aeld
+if [ $# -ge 1 ] && [ "${1#-}" = "$1" ]; then
+    OUTDIR=$1
+    shift
+fi
+ARCH=arm64
+CROSS_COMPILE=aarch64-none-linux-gnu-
+SMP=${SMP:-4}
+MODULE_ARGS=${MODULE_ARGS:-}
+REPO_DIR=$(realpath $(dirname $0)/..)
+
+KERNEL_IMAGE=${OUTDIR}/Image
+INITRD_IMAGE=${OUTDIR}/initramfs.cpio.gz
+KERNEL_DIR=${OUTDIR}/linux-stable
+OVERLAY_DIR=${OUTDIR}/aesdchar-bench-overlay
+BENCH_INITRD=${OUTDIR}/aesdchar-bench-initramfs.cpio.gz
+
+for f in ${KERNEL_IMAGE} ${INITRD_IMAGE} ${KERNEL_DIR}; do
+    if [ ! -e ${f} ]; then
+        echo "Missing ${f}, run finder-app/manual-linux.sh ${OUTDIR} first"
+        exit 1
+    fi
+done
+
+echo "Building aesdchar.ko against ${KERNEL_DIR}"
+make -C ${REPO_DIR}/aesd-char-driver KERNELDIR=${KERNEL_DIR} ARCH=${ARCH} CROSS_COMPILE=${CROSS_COMPILE} modules
+
+echo "Building aesdchar-stress"
+rm -rf ${OVERLAY_DIR}
+mkdir -p ${OVERLAY_DIR}/home ${OVERLAY_DIR}/etc
+${CROSS_COMPILE}gcc -O2 -static -pthread -I${REPO_DIR}/aesd-char-driver \
+    -o ${OVERLAY_DIR}/home/aesdchar-stress ${REPO_DIR}/benchmarks/aesdchar-stress.c
+cp ${REPO_DIR}/aesd-char-driver/aesdchar.ko ${REPO_DIR}/aesd-char-driver/aesdchar_load ${OVERLAY_DIR}/home/
+
+# aesdchar_load gives the device nodes to group wheel
+printf 'root:x:0:\nwheel:x:10:root\n' > ${OVERLAY_DIR}/etc/group
+
+cat > ${OVERLAY_DIR}/home/aesdchar-bench-init.sh <<EOF
+#!/bin/sh
+mount -t proc proc /proc
+mount -t sysfs sysfs /sys
+cd /home
+./aesdchar_load ${MODULE_ARGS}
+echo "@@@ aesdchar-bench begin"
+./aesdchar-stress $*
+echo "@@@ aesdchar-bench end"
+reboot -f
+EOF
+chmod +x ${OVERLAY_DIR}/home/aesdchar-bench-init.sh
+
+# the kernel unpacks concatenated archives in order, so the overlay is added to the stock
+# initramfs without unpacking it
+cd ${OVERLAY_DIR}
+find . | cpio -H newc -o --owner root:root | gzip > ${OUTDIR}/aesdchar-bench-overlay.cpio.gz
+cat ${INITRD_IMAGE} ${OUTDIR}/aesdchar-bench-overlay.cpio.gz > ${BENCH_INITRD}
+
+echo "Booting the kernel with ${SMP} cpus"
+qemu-system-aarch64 \
+        -m 512M \
+        -M virt \
+        -cpu cortex-a53 \
+        -nographic \
+        -no-reboot \
+        -smp ${SMP} \
+        -kernel ${KERNEL_IMAGE} \
+        -append "rdinit=/home/aesdchar-bench-init.sh console=ttyAMA0" -initrd ${BENCH_INITRD} \
+        < /dev/null | tee ${OUTDIR}/aesdchar-bench.log
+
+sed -n '/^@@@ aesdchar-bench begin/,/^@@@ aesdchar-bench end/p' ${OUTDIR}/aesdchar-bench.log \
+    | tr -d '\r' | grep -E '^(op|write|read|seek),' > ${OUTDIR}/aesdchar-bench.csv || true
+if [ ! -s ${OUTDIR}/aesdchar-bench.csv ]; then
+    echo "No benchmark results, see ${OUTDIR}/aesdchar-bench.log"
+    exit 1
+fi
+echo "Results in ${OUTDIR}/aesdchar-bench.csv"
+cat ${OUTDIR}/aesdchar-bench.csv
@@ -0,0 +1,351 @@
+/**
+ * @file aesdchar-stress.c
+ * @brief Concurrent load generator for the aesdchar driver
+ *
+ * Runs writer, reader and seeker threads against an aesdchar device for a fixed time, each on
+ * its own file descriptor:
+ *     write   appends one newline terminated record of --size bytes
+ *     read    reads up to --read-size bytes from offset 0 with pread
+ *     seek    AESDCHAR_IOCSEEKTO to a random live entry, then reads up to --read-size bytes
+ * The mix is set by the number of threads of each kind.  Every call is timed, and the results
+ * are printed as csv on stdout, one row per operation kind:
+ *     op,threads,ops,errors,ops_per_sec,p50_ns,p90_ns,p99_ns,p999_ns,max_ns
+ * Percentiles come from a log linear histogram and are accurate to about 3%.
+ *
+ * The device must be loaded, for instance with aesd-char-driver/aesdchar_load.
+ * benchmarks/aesdchar-qemu-bench.sh runs this program inside the QEMU image built by
+ * finder-app/manual-linux.sh.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "aesd_ioctl.h"
+
+#define DEFAULT_DEVICE "/dev/aesdchar"
+#define DEFAULT_DURATION_S 10
+#define DEFAULT_RECORD_SIZE 64
+#define DEFAULT_READ_SIZE 4096
+/* Seekers refresh their view of the live entries this often */
+#define SEEK_REFRESH_OPS 256
+
+/*
+ * Histogram buckets: values below 2 * HIST_SUB are exact, above that each power of two is
+ * split in HIST_SUB linear buckets
+ */
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1U << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+enum op {
+    OP_WRITE,
+    OP_READ,
+    OP_SEEK,
+    OP_COUNT
+};
+
+static const char *const op_names[OP_COUNT] = { "write", "read", "seek" };
+
+struct worker {
+    pthread_t thread;
+    enum op op;
+    unsigned int id;
+    uint64_t ops;
+    uint64_t errors;
+    uint64_t max_ns;
+    uint64_t hist[HIST_BUCKETS];
+};
+
+static const char *device = DEFAULT_DEVICE;
+static size_t record_size = DEFAULT_RECORD_SIZE;
+static size_t read_size = DEFAULT_READ_SIZE;
+static atomic_bool stop;
+static pthread_barrier_t start_barrier;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned int hist_bucket(uint64_t ns)
+{
+    unsigned int shift;
+
+    if (ns < 2 * HIST_SUB) {
+        return ns;
+    }
+    shift = 63 - __builtin_clzll(ns) - HIST_SUB_BITS;
+    return shift * HIST_SUB + (unsigned int)(ns >> shift);
+}
+
+/* the smallest value counted in @bucket */
+static uint64_t hist_value(unsigned int bucket)
+{
+    unsigned int shift;
+
+    if (bucket < 2 * HIST_SUB) {
+        return bucket;
+    }
+    shift = bucket / HIST_SUB - 1;
+    return (uint64_t)(bucket - shift * HIST_SUB) << shift;
+}
+
+static void record(struct worker *w, uint64_t start, bool ok)
+{
+    uint64_t ns = now_ns() - start;
+
+    w->ops++;
+    if (!ok) {
+        w->errors++;
+    }
+    w->hist[hist_bucket(ns)]++;
+    if (ns > w->max_ns) {
+        w->max_ns = ns;
+    }
+}
+
+static void run_writer(struct worker *w, int fd)
+{
+    char *buf = malloc(record_size);
+    uint64_t seq = 0;
+    uint64_t start;
+    int len;
+
+    if (!buf) {
+        return;
+    }
+    memset(buf, 'x', record_size);
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        // tag each record with its writer and sequence, which helps when reading a dump
+        len = snprintf(buf, record_size, "w%u %llu ", w->id, (unsigned long long)seq++);
+        if ((size_t)len < record_size) {
+            buf[len] = 'x';
+        }
+        buf[record_size - 1] = '\n';
+        start = now_ns();
+        record(w, start, write(fd, buf, record_size) == (ssize_t)record_size);
+    }
+    free(buf);
+}
+
+static void run_reader(struct worker *w, int fd)
+{
+    char *buf = malloc(read_size);
+    uint64_t start;
+
+    if (!buf) {
+        return;
+    }
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        start = now_ns();
+        record(w, start, pread(fd, buf, read_size, 0) >= 0);
+    }
+    free(buf);
+}
+
+static void run_seeker(struct worker *w, int fd)
+{
+    struct aesd_entry_table table = { .version = AESD_ENTRY_TABLE_VERSION };
+    struct aesd_seekto seekto = { 0 };
+    unsigned int seed = w->id;
+    char *buf = malloc(read_size);
+    uint64_t start;
+    bool ok;
+
+    if (!buf) {
+        return;
+    }
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        if (w->ops % SEEK_REFRESH_OPS == 0 &&
+                (ioctl(fd, AESDCHAR_IOCGENTRIES, &table) != 0 || table.count == 0)) {
+            // nothing written yet
+            table.count = 0;
+            sched_yield();
+            continue;
+        }
+        seekto.write_cmd = rand_r(&seed) % table.count;
+        start = now_ns();
+        ok = ioctl(fd, AESDCHAR_IOCSEEKTO, &seekto) == 0 && read(fd, buf, read_size) >= 0;
+        record(w, start, ok);
+    }
+    free(buf);
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    int fd = open(device, w->op == OP_WRITE ? O_WRONLY : O_RDONLY);
+
+    pthread_barrier_wait(&start_barrier);
+    if (fd < 0) {
+        fprintf(stderr, "open %s: %s\n", device, strerror(errno));
+        return NULL;
+    }
+    switch (w->op) {
+    case OP_WRITE:
+        run_writer(w, fd);
+        break;
+    case OP_READ:
+        run_reader(w, fd);
+        break;
+    default:
+        run_seeker(w, fd);
+        break;
+    }
+    close(fd);
+    return NULL;
+}
+
+static uint64_t percentile(const uint64_t *hist, uint64_t total, double pct)
+{
+    uint64_t rank = (uint64_t)(total * pct / 100.0);
+    uint64_t seen = 0;
+    unsigned int i;
+
+    if (total == 0) {
+        return 0;
+    }
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen > rank) {
+            return hist_value(i);
+        }
+    }
+    return hist_value(HIST_BUCKETS - 1);
+}
+
+static void report(enum op op, const struct worker *workers, unsigned int nworkers, double seconds)
+{
+    static uint64_t hist[HIST_BUCKETS];
+    uint64_t ops = 0, errors = 0, max_ns = 0;
+    unsigned int threads = 0;
+    unsigned int i, b;
+
+    memset(hist, 0, sizeof(hist));
+    for (i = 0; i < nworkers; i++) {
+        if (workers[i].op != op) {
+            continue;
+        }
+        threads++;
+        ops += workers[i].ops;
+        errors += workers[i].errors;
+        if (workers[i].max_ns > max_ns) {
+            max_ns = workers[i].max_ns;
+        }
+        for (b = 0; b < HIST_BUCKETS; b++) {
+            hist[b] += workers[i].hist[b];
+        }
+    }
+    if (threads == 0) {
+        return;
+    }
+    printf("%s,%u,%llu,%llu,%.0f,%llu,%llu,%llu,%llu,%llu\n", op_names[op], threads,
+            (unsigned long long)ops, (unsigned long long)errors, ops / seconds,
+            (unsigned long long)percentile(hist, ops, 50),
+            (unsigned long long)percentile(hist, ops, 90),
+            (unsigned long long)percentile(hist, ops, 99),
+            (unsigned long long)percentile(hist, ops, 99.9),
+            (unsigned long long)max_ns);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [--device path] [--duration seconds] [--writers n] [--readers n]\n"
+            "       [--seekers n] [--size record_bytes] [--read-size bytes] [--no-header]\n"
+            "defaults: %s, %d s, 1 writer, 1 reader, 1 seeker, %d byte records, %d byte reads\n",
+            prog, DEFAULT_DEVICE, DEFAULT_DURATION_S, DEFAULT_RECORD_SIZE, DEFAULT_READ_SIZE);
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int nthreads[OP_COUNT] = { 1, 1, 1 };
+    unsigned int duration = DEFAULT_DURATION_S;
+    bool header = true;
+    struct worker *workers;
+    unsigned int nworkers;
+    struct timespec delay;
+    uint64_t start;
+    double seconds;
+    unsigned int i, n;
+    int op;
+
+    for (i = 1; i < (unsigned int)argc; i++) {
+        if (strcmp(argv[i], "--device") == 0 && i + 1 < (unsigned int)argc) {
+            device = argv[++i];
+        } else if (strcmp(argv[i], "--duration") == 0 && i + 1 < (unsigned int)argc) {
+            duration = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--writers") == 0 && i + 1 < (unsigned int)argc) {
+            nthreads[OP_WRITE] = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--readers") == 0 && i + 1 < (unsigned int)argc) {
+            nthreads[OP_READ] = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--seekers") == 0 && i + 1 < (unsigned int)argc) {
+            nthreads[OP_SEEK] = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < (unsigned int)argc) {
+            record_size = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--read-size") == 0 && i + 1 < (unsigned int)argc) {
+            read_size = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--no-header") == 0) {
+            header = false;
+        } else {
+            usage(argv[0]);
+        }
+    }
+    nworkers = nthreads[OP_WRITE] + nthreads[OP_READ] + nthreads[OP_SEEK];
+    if (nworkers == 0 || duration == 0 || record_size == 0 || read_size == 0) {
+        usage(argv[0]);
+    }
+
+    workers = calloc(nworkers, sizeof(*workers));
+    if (!workers) {
+        perror("calloc");
+        return 1;
+    }
+    pthread_barrier_init(&start_barrier, NULL, nworkers + 1);
+    n = 0;
+    for (op = 0; op < OP_COUNT; op++) {
+        for (i = 0; i < nthreads[op]; i++, n++) {
+            workers[n].op = op;
+            workers[n].id = n;
+            if (pthread_create(&workers[n].thread, NULL, worker_main, &workers[n]) != 0) {
+                perror("pthread_create");
+                return 1;
+            }
+        }
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    start = now_ns();
+    delay.tv_sec = duration;
+    delay.tv_nsec = 0;
+    while (nanosleep(&delay, &delay) != 0 && errno == EINTR) {
+    }
+    atomic_store(&stop, true);
+    for (i = 0; i < nworkers; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    seconds = (now_ns() - start) / 1e9;
+
+    if (header) {
+        printf("op,threads,ops,errors,ops_per_sec,p50_ns,p90_ns,p99_ns,p999_ns,max_ns\n");
+    }
+    for (op = 0; op < OP_COUNT; op++) {
+        report(op, workers, nworkers, seconds);
+    }
+    pthread_barrier_destroy(&start_barrier);
+    free(workers);
+    return 0;
+}
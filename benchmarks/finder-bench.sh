@@ -0,0 +1,66 @@
+#!/bin/bash
+# Compares finder-app/finder with finder-app/finder.sh on a generated tree.
+#
+# Usage: finder-bench.sh [dirs] [files per dir] [lines per file]
+#     defaults to 200 directories of 100 files of 500 lines, about 300 MB, under
+#     ${TMPDIR:-/tmp}/finder-bench.  The tree is reused while its parameters stay the same.
+# Prints one csv row per program with the best wall time of 3 runs in seconds:
+#     program,files,matching_lines,seconds
+# finder-index is finder with FINDER_INDEX set, timed after one untimed run filled the index.
+
+set -e
+set -u
+
+NDIRS=${1:-200}
+NFILES=${2:-100}
+NLINES=${3:-500}
+SEARCHSTR=AELD_IS_FUN
+REPO_DIR=$(realpath $(dirname $0)/..)
+TREE=${TMPDIR:-/tmp}/finder-bench
+STAMP="${NDIRS} ${NFILES} ${NLINES}"
+
+make -s -C ${REPO_DIR}/finder-app CROSS_COMPILER_PREFIX= CC=${CC:-gcc} finder
+
+if [ "$(cat ${TREE}/.params 2>/dev/null)" != "${STAMP}" ]; then
+    echo "Generating ${NDIRS}x${NFILES} files of ${NLINES} lines in ${TREE}" >&2
+    rm -rf ${TREE}
+    mkdir -p ${TREE}
+    # one line in 50 holds the search string
+    awk -v n=${NLINES} -v s=${SEARCHSTR} 'BEGIN {
+        for (i = 0; i < n; i++) {
+            printf "line %d of some filler text for the finder benchmark %s\n", i, (i % 50 == 7) ? s : "xxxxxxxxxxx"
+        }
+    }' > ${TREE}/template
+    for d in $(seq 1 ${NDIRS}); do
+        mkdir -p ${TREE}/dir$((d % 10))/sub${d}
+        for f in $(seq 1 ${NFILES}); do
+            cp ${TREE}/template ${TREE}/dir$((d % 10))/sub${d}/file${f}.txt
+        done
+    done
+    rm ${TREE}/template
+    echo "${STAMP}" > ${TREE}/.params
+    # finder does not index files changed in the last 2 seconds
+    sleep 2
+fi
+
+INDEX=${TREE}.index
+rm -f ${INDEX}
+FINDER_INDEX=${INDEX} ${REPO_DIR}/finder-app/finder ${TREE} ${SEARCHSTR} > /dev/null
+
+echo "program,files,matching_lines,seconds"
+for program in finder.sh finder finder-index; do
+    best=
+    for run in 1 2 3; do
+        start=$(date +%s.%N)
+        if [ ${program} = finder-index ]; then
+            output=$(FINDER_INDEX=${INDEX} ${REPO_DIR}/finder-app/finder ${TREE} ${SEARCHSTR})
+        else
+            output=$(${REPO_DIR}/finder-app/${program} ${TREE} ${SEARCHSTR})
+        fi
+        end=$(date +%s.%N)
+        best=$(echo "${start} ${end} ${best}" | awk '{ t = $2 - $1; if ($3 == "" || t < $3) print t; else print $3 }')
+    done
+    # the .params file counts as one file for both programs
+    echo "${output}" | awk -v p=${program} -v t=${best} \
+        '{ printf "%s,%s,%s,%.3f\n", p, $6, $NF, t }'
+done
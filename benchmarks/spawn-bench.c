@@ -0,0 +1,165 @@
+/**
+ * @file spawn-bench.c
+ * @brief Process spawn latency against the size of the parent, fork + execv versus posix_spawn
+ *
+ * For each parent size the benchmark maps and touches that many MiB of anonymous memory, then
+ * times --spawns runs of --command, each started and waited for by:
+ *     fork     fork, execv and waitpid, as do_exec in examples/systemcalls did before
+ *     spawn    do_exec from examples/systemcalls/systemcalls.c, built on posix_spawn
+ * Results are printed as csv on stdout, one row per method and parent size:
+ *     method,rss_mib,spawns,mean_us,p50_us,p99_us,max_us
+ * fork copies the page tables of the parent, so its cost grows with rss_mib, while spawn
+ * should stay flat.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "systemcalls.h"
+
+#define DEFAULT_COMMAND "/bin/true"
+#define DEFAULT_SPAWNS 200
+#define DEFAULT_SIZES "0,16,64,256"
+
+static const char *command = DEFAULT_COMMAND;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool fork_exec(void)
+{
+    char *argv[] = { (char *)command, NULL };
+    pid_t pid;
+    int status;
+
+    pid = fork();
+    if (pid < 0) {
+        return false;
+    }
+    if (pid == 0) {
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    if (waitpid(pid, &status, 0) < 0) {
+        return false;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static bool spawn_exec(void)
+{
+    return do_exec(1, command);
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void run(const char *method, bool (*spawn)(void), unsigned long rss_mib,
+        unsigned int spawns, uint64_t *ns)
+{
+    uint64_t start, total = 0;
+    unsigned int i;
+
+    for (i = 0; i < spawns; i++) {
+        start = now_ns();
+        if (!spawn()) {
+            fprintf(stderr, "%s: %s failed\n", method, command);
+            exit(1);
+        }
+        ns[i] = now_ns() - start;
+        total += ns[i];
+    }
+    qsort(ns, spawns, sizeof(*ns), compare_u64);
+    printf("%s,%lu,%u,%.1f,%.1f,%.1f,%.1f\n", method, rss_mib, spawns,
+            total / 1e3 / spawns, ns[spawns / 2] / 1e3, ns[(uint64_t)spawns * 99 / 100] / 1e3,
+            ns[spawns - 1] / 1e3);
+    fflush(stdout);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [--command path] [--spawns n] [--sizes mib,...] [--no-header]\n"
+            "defaults: %s, %d spawns, parents of %s MiB\n",
+            prog, DEFAULT_COMMAND, DEFAULT_SPAWNS, DEFAULT_SIZES);
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int spawns = DEFAULT_SPAWNS;
+    char *sizes = strdup(DEFAULT_SIZES);
+    unsigned long rss_mib;
+    bool header = true;
+    char *size, *end;
+    uint64_t *ns;
+    void *mem;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--command") == 0 && i + 1 < argc) {
+            command = argv[++i];
+        } else if (strcmp(argv[i], "--spawns") == 0 && i + 1 < argc) {
+            spawns = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc) {
+            free(sizes);
+            sizes = strdup(argv[++i]);
+        } else if (strcmp(argv[i], "--no-header") == 0) {
+            header = false;
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (spawns == 0 || !sizes) {
+        usage(argv[0]);
+    }
+    ns = calloc(spawns, sizeof(*ns));
+    if (!ns) {
+        perror("calloc");
+        return 1;
+    }
+
+    if (header) {
+        printf("method,rss_mib,spawns,mean_us,p50_us,p99_us,max_us\n");
+    }
+    for (size = strtok(sizes, ","); size; size = strtok(NULL, ",")) {
+        rss_mib = strtoul(size, &end, 0);
+        if (*end != '\0') {
+            usage(argv[0]);
+        }
+        mem = NULL;
+        if (rss_mib) {
+            mem = mmap(NULL, rss_mib << 20, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (mem == MAP_FAILED) {
+                fprintf(stderr, "mmap %lu MiB: %s\n", rss_mib, strerror(errno));
+                return 1;
+            }
+            // every page must be resident for fork to have page tables to copy
+            memset(mem, 1, rss_mib << 20);
+        }
+        run("fork", fork_exec, rss_mib, spawns, ns);
+        run("spawn", spawn_exec, rss_mib, spawns, ns);
+        if (mem) {
+            munmap(mem, rss_mib << 20);
+        }
+    }
+    free(ns);
+    free(sizes);
+    return 0;
+}
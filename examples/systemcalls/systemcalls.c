@@ -1,12 +1,19 @@
+#define _GNU_SOURCE
 #include "systemcalls.h"
+#include <errno.h>
 #include <stdlib.h>
 #include <sched.h>
+#include <spawn.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 
 /**
  * @param cmd the command to execute with system()
@@ -35,6 +42,54 @@ bool do_system(const char *cmd)
     }
 }
 
+/**
+ * Runs @param command, a NULL terminated argument vector whose first element is the full path
+ * of the program, with standard output sent to @param outputfile unless it is NULL, and waits
+ * for it.
+ *
+ * The child is started with posix_spawn rather than fork, so the caller's page tables are not
+ * copied and the cost of a call does not grow with the caller's memory size.  glibc and musl
+ * implement it with clone(CLONE_VM | CLONE_VFORK) and report a failed open or exec as an error
+ * of posix_spawn itself.
+ * @return true if the command ran and exited with status 0
+ */
+static bool spawn_and_wait(char *const command[], const char *outputfile)
+{
+    extern char **environ;
+    posix_spawn_file_actions_t actions;
+    pid_t pid;
+    int status;
+    int ret;
+
+    if (posix_spawn_file_actions_init(&actions) != 0)
+    {
+        return false;
+    }
+    if (outputfile &&
+            posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, outputfile,
+                O_WRONLY | O_CREAT | O_TRUNC, 0644) != 0)
+    {
+        posix_spawn_file_actions_destroy(&actions);
+        return false;
+    }
+    // output the caller buffered so far comes before the command's
+    fflush(stdout);
+    ret = posix_spawn(&pid, command[0], &actions, NULL, command, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (ret != 0)
+    {
+        return false;
+    }
+    while (waitpid(pid, &status, 0) < 0)
+    {
+        if (errno != EINTR)
+        {
+            return false;
+        }
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
 /**
 * @param count -The numbers of variables passed to the function. The variables are command to execute.
 *   followed by arguments to pass to the command
@@ -60,50 +115,9 @@ bool do_exec(int count, ...)
         command[i] = va_arg(args, char *);
     }
     command[count] = NULL;
-    // this line is to avoid a compile warning before your implementation is complete
-    // and may be removed
-    command[count] = command[count];
-
-/*
- * TODO:
- *   Execute a system command by calling fork, execv(),
- *   and wait instead of system (see LSP page 161).
- *   Use the command[0] as the full path to the command to execute
- *   (first argument to execv), and use the remaining arguments
- *   as second argument to the execv() command.
- *
-*/
-    pid_t pid;
-    fflush(stdout);
-    pid = fork();
-    if (pid == -1)
-    {
-        return false; 
-    }
-    else if (pid == 0)
-    {
-        execv(command[0], command);
-        exit(-1);
-    }
-    else
-    {
-        int status;
-        waitpid(pid, &status, 0);
-        if (WIFEXITED(status))
-        {
-            if (WEXITSTATUS(status) == 0)
-            {
-                return true;
-            }
-            else
-            {
-                return false;
-            }
-        }
-    }
     va_end(args);
 
-    return true;
+    return spawn_and_wait(command, NULL);
 }
 
 /**
@@ -122,58 +136,365 @@ bool do_exec_redirect(const char *outputfile, int count, ...)
         command[i] = va_arg(args, char *);
     }
     command[count] = NULL;
-    // this line is to avoid a compile warning before your implementation is complete
-    // and may be removed
-    command[count] = command[count];
+    va_end(args);
 
+    return spawn_and_wait(command, outputfile);
+}
 
-/*
- * TODO
- *   Call execv, but first using https://stackoverflow.com/a/13784315/1446624 as a refernce,
- *   redirect standard out to a file specified by outputfile.
- *   The rest of the behaviour is same as do_exec()
- *
-*/
+/* Bytes read from a command's pipe at a time */
+#define EXEC_BATCH_READ_SIZE 65536
+
+/**
+ * A running command of do_exec_batch, with the read ends of its stdout and stderr pipes,
+ * -1 once they reached end of file
+ */
+struct exec_slot
+{
+    struct exec_command *command;
     pid_t pid;
-    int fd = open(outputfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (fd < 0)
+    int fd[2];
+    size_t cap[2];
+    /* Readable once the command exited, -1 on kernels without pidfd_open */
+    int pidfd;
+    /* pidfd is in the current poll set */
+    bool pidfd_polled;
+    uint64_t start_ns;
+};
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Starts @param command in @param slot with its stdout and stderr on pipes
+ * @return 0 or an errno value
+ */
+static int exec_slot_start(struct exec_slot *slot, struct exec_command *command)
+{
+    extern char **environ;
+    posix_spawn_file_actions_t actions;
+    int out[2], err[2];
+    int ret;
+
+    if (pipe2(out, O_CLOEXEC) != 0)
+    {
+        return errno;
+    }
+    if (pipe2(err, O_CLOEXEC) != 0)
+    {
+        ret = errno;
+        close(out[0]);
+        close(out[1]);
+        return ret;
+    }
+    // dup2 clears close on exec on the copies the command gets
+    ret = posix_spawn_file_actions_init(&actions);
+    if (ret == 0)
+    {
+        ret = posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+        if (ret == 0)
+        {
+            ret = posix_spawn_file_actions_adddup2(&actions, err[1], STDERR_FILENO);
+        }
+        if (ret == 0)
+        {
+            slot->start_ns = monotonic_ns();
+            ret = posix_spawn(&slot->pid, command->argv[0], &actions, NULL, command->argv, environ);
+        }
+        posix_spawn_file_actions_destroy(&actions);
+    }
+    close(out[1]);
+    close(err[1]);
+    if (ret != 0)
+    {
+        close(out[0]);
+        close(err[0]);
+        return ret;
+    }
+    slot->command = command;
+    slot->fd[0] = out[0];
+    slot->fd[1] = err[0];
+    slot->cap[0] = 0;
+    slot->cap[1] = 0;
+    slot->pidfd = syscall(SYS_pidfd_open, slot->pid, 0);
+    slot->pidfd_polled = false;
+    return 0;
+}
+
+/**
+ * Appends what can be read from pipe @param which of @param slot to the command's output,
+ * closing the pipe at end of file or on error
+ */
+static void exec_slot_read(struct exec_slot *slot, int which)
+{
+    char **buf = which == 0 ? &slot->command->out : &slot->command->err;
+    size_t *len = which == 0 ? &slot->command->out_len : &slot->command->err_len;
+    size_t cap = slot->cap[which];
+    char *grown;
+    ssize_t ret;
+
+    if (cap - *len < EXEC_BATCH_READ_SIZE + 1)
+    {
+        cap = cap ? cap * 2 : EXEC_BATCH_READ_SIZE + 1;
+        grown = realloc(*buf, cap);
+        if (!grown)
+        {
+            // out of memory, drop the rest of the output
+            close(slot->fd[which]);
+            slot->fd[which] = -1;
+            return;
+        }
+        *buf = grown;
+        (*buf)[*len] = '\0';
+        slot->cap[which] = cap;
+    }
+    ret = read(slot->fd[which], *buf + *len, EXEC_BATCH_READ_SIZE);
+    if (ret < 0 && errno == EINTR)
+    {
+        return;
+    }
+    if (ret <= 0)
+    {
+        close(slot->fd[which]);
+        slot->fd[which] = -1;
+        return;
+    }
+    *len += ret;
+    (*buf)[*len] = '\0';
+}
+
+/**
+ * Records the result of the command of @param slot, reaped with wait status @param status
+ * unless @param error is non zero, and frees the slot
+ * @return true if the command exited with status 0
+ */
+static bool exec_slot_finish(struct exec_slot *slot, int error, int status)
+{
+    struct exec_command *command = slot->command;
+
+    command->elapsed_ns = monotonic_ns() - slot->start_ns;
+    if (slot->pidfd >= 0)
+    {
+        close(slot->pidfd);
+    }
+    if (command->out_len == 0)
+    {
+        free(command->out);
+        command->out = NULL;
+    }
+    if (command->err_len == 0)
     {
+        free(command->err);
+        command->err = NULL;
+    }
+    slot->command = NULL;
+    if (error)
+    {
+        command->error = error;
         return false;
     }
-    fflush(stdout);
-    pid = fork();
-    if (pid == -1)
+    command->status = status;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/**
+ * Stops collecting output after an error @param error: closes the pipes of every running
+ * command, waits for it and records @param error with what it captured so far
+ */
+static void exec_batch_abort(struct exec_slot *slots, size_t nslots, int error)
+{
+    int status = 0;
+    pid_t pid;
+    size_t i;
+
+    for (i = 0; i < nslots; i++)
     {
-        return false; 
+        if (!slots[i].command)
+        {
+            continue;
+        }
+        if (slots[i].fd[0] >= 0)
+        {
+            close(slots[i].fd[0]);
+        }
+        if (slots[i].fd[1] >= 0)
+        {
+            close(slots[i].fd[1]);
+        }
+        while ((pid = waitpid(slots[i].pid, &status, 0)) < 0 && errno == EINTR)
+        {
+        }
+        // the exit status is kept, but the output may be incomplete
+        if (pid > 0)
+        {
+            slots[i].command->status = status;
+        }
+        exec_slot_finish(&slots[i], error, status);
     }
-    else if (pid == 0)
+}
+
+/**
+ * Runs @param count commands, at most @param max_parallel of them at a time or all at once for
+ * 0, and collects their output and exit status.  Output is read from pipes as it arrives, so
+ * commands never block on a full pipe.  Once both its pipes are closed a command is waited for
+ * through its pidfd, which polls readable when it exits.  The caller frees the output with
+ * exec_command_release.
+ * @return true if every command was started and exited with status 0
+ */
+bool do_exec_batch(struct exec_command *commands, size_t count, unsigned int max_parallel)
+{
+    struct exec_slot *slots;
+    struct pollfd *fds;
+    size_t nslots, next, running, nfds, i;
+    int status, ret, which;
+    bool ok = true;
+    bool tick;
+    pid_t pid;
+
+    for (i = 0; i < count; i++)
+    {
+        commands[i].status = -1;
+        commands[i].error = 0;
+        commands[i].out = NULL;
+        commands[i].out_len = 0;
+        commands[i].err = NULL;
+        commands[i].err_len = 0;
+        commands[i].elapsed_ns = 0;
+    }
+    nslots = (max_parallel == 0 || max_parallel > count) ? count : max_parallel;
+    if (nslots == 0)
+    {
+        return true;
+    }
+    slots = calloc(nslots, sizeof(*slots));
+    fds = calloc(nslots * 2, sizeof(*fds));
+    if (!slots || !fds)
     {
-        if (dup2(fd, 1) < 0)
+        free(slots);
+        free(fds);
+        for (i = 0; i < count; i++)
         {
-            close(fd);
-            return false;
+            commands[i].error = ENOMEM;
         }
-        close(fd);
-        execv(command[0], command);
-        exit(-1);
+        return false;
     }
-    else
+    // output the caller buffered so far comes before the commands'
+    fflush(stdout);
+    next = 0;
+    running = 0;
+    while (next < count || running > 0)
     {
-        int status;
-        waitpid(pid, &status, 0);
-        if (WIFEXITED(status))
+        for (i = 0; i < nslots; i++)
+        {
+            while (!slots[i].command && next < count)
+            {
+                ret = exec_slot_start(&slots[i], &commands[next]);
+                if (ret != 0)
+                {
+                    commands[next].error = ret;
+                    ok = false;
+                }
+                else
+                {
+                    running++;
+                }
+                next++;
+            }
+        }
+
+        // the pipes of each command, or its pidfd once both pipes are closed
+        nfds = 0;
+        tick = false;
+        for (i = 0; i < nslots; i++)
+        {
+            if (!slots[i].command)
+            {
+                continue;
+            }
+            for (which = 0; which < 2; which++)
+            {
+                if (slots[i].fd[which] >= 0)
+                {
+                    fds[nfds].fd = slots[i].fd[which];
+                    fds[nfds].events = POLLIN;
+                    fds[nfds].revents = 0;
+                    nfds++;
+                }
+            }
+            slots[i].pidfd_polled = slots[i].fd[0] < 0 && slots[i].fd[1] < 0 && slots[i].pidfd >= 0;
+            if (slots[i].pidfd_polled)
+            {
+                fds[nfds].fd = slots[i].pidfd;
+                fds[nfds].events = POLLIN;
+                fds[nfds].revents = 0;
+                nfds++;
+            }
+            // without pidfd_open a command which closed its output is checked every millisecond
+            tick |= slots[i].fd[0] < 0 && slots[i].fd[1] < 0 && slots[i].pidfd < 0;
+        }
+        if (running > 0 && poll(fds, nfds, tick ? 1 : -1) < 0 && errno != EINTR)
+        {
+            ok = false;
+            ret = errno;
+            exec_batch_abort(slots, nslots, ret);
+            for (; next < count; next++)
+            {
+                commands[next].error = ret;
+            }
+            break;
+        }
+
+        // fds lists the polled descriptors in slot order
+        nfds = 0;
+        for (i = 0; i < nslots; i++)
         {
-            if (WEXITSTATUS(status) == 0)
+            if (!slots[i].command)
             {
-                return true;
+                continue;
             }
-            else
+            for (which = 0; which < 2; which++)
             {
-                return false;
+                if (slots[i].fd[which] >= 0)
+                {
+                    if (fds[nfds].revents)
+                    {
+                        exec_slot_read(&slots[i], which);
+                    }
+                    nfds++;
+                }
             }
+            if (slots[i].pidfd_polled)
+            {
+                nfds++;
+            }
+            if (slots[i].fd[0] >= 0 || slots[i].fd[1] >= 0)
+            {
+                continue;
+            }
+            pid = waitpid(slots[i].pid, &status, WNOHANG);
+            if (pid == 0 || (pid < 0 && errno == EINTR))
+            {
+                continue;
+            }
+            ok = exec_slot_finish(&slots[i], pid < 0 ? errno : 0, status) && ok;
+            running--;
         }
     }
-    va_end(args);
-    close(fd);
-    return true;
+    free(slots);
+    free(fds);
+    return ok;
+}
+
+void exec_command_release(struct exec_command *command)
+{
+    free(command->out);
+    free(command->err);
+    command->out = NULL;
+    command->err = NULL;
+    command->out_len = 0;
+    command->err_len = 0;
 }
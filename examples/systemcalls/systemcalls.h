@@ -1,9 +1,35 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 
 bool do_system(const char *command);
 
 bool do_exec(int count, ...);
 
 bool do_exec_redirect(const char *outputfile, int count, ...);
+
+/**
+ * One command of do_exec_batch.  The caller sets argv, the rest is filled in by the call.
+ */
+struct exec_command
+{
+    /* NULL terminated argument vector, argv[0] is the full path of the program */
+    char *const *argv;
+    /* waitpid status, or -1 if the command could not be started */
+    int status;
+    /* errno of a failed start, 0 otherwise */
+    int error;
+    /* Standard output and error of the command, malloced and NUL terminated, or NULL if empty */
+    char *out;
+    size_t out_len;
+    char *err;
+    size_t err_len;
+    /* Time from start to exit */
+    uint64_t elapsed_ns;
+};
+
+bool do_exec_batch(struct exec_command *commands, size_t count, unsigned int max_parallel);
+
+void exec_command_release(struct exec_command *command);
@@ -1,4 +1,5 @@
 #include "threading.h"
+#include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -87,3 +88,295 @@ bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex,int
     return true;
 }
 
+
+#define NSEC_PER_SEC 1000000000L
+
+struct thread_pool{
+    pthread_mutex_t lock;
+    /* Signalled when a job is queued or the pool stops, waited on with CLOCK_MONOTONIC */
+    pthread_cond_t queued;
+    /* Broadcast when a job completed */
+    pthread_cond_t completed;
+    /* Binary min heap of queued jobs by obtain_at, then seq */
+    struct mutex_job **heap;
+    size_t heap_len;
+    size_t heap_cap;
+    unsigned long next_seq;
+    bool stopping;
+    unsigned int nthreads;
+    pthread_t threads[];
+};
+
+static void timespec_add_ms(struct timespec *ts, int ms)
+{
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (long)(ms % 1000) * 1000000L;
+    if(ts->tv_nsec >= NSEC_PER_SEC)
+    {
+        ts->tv_sec++;
+        ts->tv_nsec -= NSEC_PER_SEC;
+    }
+}
+
+static bool job_before(const struct mutex_job *a, const struct mutex_job *b)
+{
+    if(a->obtain_at.tv_sec != b->obtain_at.tv_sec)
+    {
+        return a->obtain_at.tv_sec < b->obtain_at.tv_sec;
+    }
+    if(a->obtain_at.tv_nsec != b->obtain_at.tv_nsec)
+    {
+        return a->obtain_at.tv_nsec < b->obtain_at.tv_nsec;
+    }
+    return a->seq < b->seq;
+}
+
+static void heap_push(struct thread_pool *pool, struct mutex_job *job)
+{
+    size_t i = pool->heap_len++;
+    size_t parent;
+
+    while(i > 0)
+    {
+        parent = (i - 1) / 2;
+        if(!job_before(job, pool->heap[parent]))
+        {
+            break;
+        }
+        pool->heap[i] = pool->heap[parent];
+        i = parent;
+    }
+    pool->heap[i] = job;
+}
+
+static struct mutex_job *heap_pop(struct thread_pool *pool)
+{
+    struct mutex_job *top = pool->heap[0];
+    struct mutex_job *last = pool->heap[--pool->heap_len];
+    size_t i = 0;
+    size_t child;
+
+    while((child = 2 * i + 1) < pool->heap_len)
+    {
+        if(child + 1 < pool->heap_len && job_before(pool->heap[child + 1], pool->heap[child]))
+        {
+            child++;
+        }
+        if(!job_before(pool->heap[child], last))
+        {
+            break;
+        }
+        pool->heap[i] = pool->heap[child];
+        i = child;
+    }
+    pool->heap[i] = last;
+    return top;
+}
+
+/**
+ * Obtains, holds and releases the mutex of @param job, whose obtain deadline has passed
+ * @return true on success
+ */
+static bool run_mutex_job(struct mutex_job *job)
+{
+    struct timespec deadline;
+    int ret;
+
+    if(job->obtain_timeout_ms < 0)
+    {
+        ret = pthread_mutex_lock(job->mutex);
+    }
+    else
+    {
+        // pthread_mutex_timedlock takes a CLOCK_REALTIME deadline
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        timespec_add_ms(&deadline, job->obtain_timeout_ms);
+        ret = pthread_mutex_timedlock(job->mutex, &deadline);
+    }
+    if(ret != 0)
+    {
+        DEBUG_LOG("could not obtain mutex: %d", ret);
+        return false;
+    }
+
+    // the hold time runs from the moment the mutex was obtained
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    timespec_add_ms(&deadline, job->wait_to_release_ms);
+    while((ret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL)) == EINTR)
+    {
+    }
+    if(ret != 0)
+    {
+        ERROR_LOG("clock_nanosleep failed");
+        pthread_mutex_unlock(job->mutex);
+        return false;
+    }
+
+    ret = pthread_mutex_unlock(job->mutex);
+    if(ret != 0)
+    {
+        ERROR_LOG("pthread_mutex_unlock failed");
+        return false;
+    }
+    return true;
+}
+
+static void* pool_threadfunc(void* pool_param)
+{
+    struct thread_pool *pool = (struct thread_pool *) pool_param;
+    struct mutex_job *job;
+    struct timespec now;
+
+    pthread_mutex_lock(&pool->lock);
+    for(;;)
+    {
+        if(pool->heap_len == 0)
+        {
+            if(pool->stopping)
+            {
+                break;
+            }
+            pthread_cond_wait(&pool->queued, &pool->lock);
+            continue;
+        }
+        // sleep until the earliest deadline, or until an earlier job is queued
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        job = pool->heap[0];
+        if(job->obtain_at.tv_sec > now.tv_sec ||
+                (job->obtain_at.tv_sec == now.tv_sec && job->obtain_at.tv_nsec > now.tv_nsec))
+        {
+            pthread_cond_timedwait(&pool->queued, &pool->lock, &job->obtain_at);
+            continue;
+        }
+        job = heap_pop(pool);
+        pthread_mutex_unlock(&pool->lock);
+
+        job->complete_success = run_mutex_job(job);
+
+        pthread_mutex_lock(&pool->lock);
+        job->done = true;
+        pthread_cond_broadcast(&pool->completed);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+struct thread_pool *thread_pool_create(unsigned int nthreads)
+{
+    struct thread_pool *pool;
+    pthread_condattr_t attr;
+    unsigned int i;
+
+    if(nthreads == 0)
+    {
+        return NULL;
+    }
+    pool = calloc(1, sizeof(*pool) + nthreads * sizeof(pool->threads[0]));
+    if(pool == NULL)
+    {
+        ERROR_LOG("malloc failed");
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    // job deadlines are on CLOCK_MONOTONIC so that clock changes do not move them
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pool->queued, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&pool->completed, NULL);
+
+    for(i = 0; i < nthreads; i++)
+    {
+        if(pthread_create(&pool->threads[i], NULL, pool_threadfunc, pool) != 0)
+        {
+            ERROR_LOG("pthread_create failed");
+            break;
+        }
+        pool->nthreads++;
+    }
+    if(pool->nthreads == 0)
+    {
+        thread_pool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+bool thread_pool_submit_obtaining_mutex(struct thread_pool *pool, struct mutex_job *job,
+        pthread_mutex_t *mutex, int wait_to_obtain_ms, int wait_to_release_ms, int obtain_timeout_ms)
+{
+    struct mutex_job **heap;
+    size_t cap;
+
+    job->wait_to_obtain_ms = wait_to_obtain_ms;
+    job->wait_to_release_ms = wait_to_release_ms;
+    job->obtain_timeout_ms = obtain_timeout_ms;
+    job->mutex = mutex;
+    job->complete_success = false;
+    job->done = false;
+    clock_gettime(CLOCK_MONOTONIC, &job->obtain_at);
+    timespec_add_ms(&job->obtain_at, wait_to_obtain_ms);
+
+    pthread_mutex_lock(&pool->lock);
+    if(pool->stopping)
+    {
+        pthread_mutex_unlock(&pool->lock);
+        return false;
+    }
+    if(pool->heap_len == pool->heap_cap)
+    {
+        cap = pool->heap_cap ? pool->heap_cap * 2 : 64;
+        heap = realloc(pool->heap, cap * sizeof(*heap));
+        if(heap == NULL)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            ERROR_LOG("malloc failed");
+            return false;
+        }
+        pool->heap = heap;
+        pool->heap_cap = cap;
+    }
+    job->seq = pool->next_seq++;
+    heap_push(pool, job);
+    // the new job may be due before the one the workers sleep for
+    if(pool->heap[0] == job)
+    {
+        pthread_cond_broadcast(&pool->queued);
+    }
+    else
+    {
+        pthread_cond_signal(&pool->queued);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return true;
+}
+
+bool thread_pool_wait(struct thread_pool *pool, struct mutex_job *job)
+{
+    pthread_mutex_lock(&pool->lock);
+    while(!job->done)
+    {
+        pthread_cond_wait(&pool->completed, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return job->complete_success;
+}
+
+void thread_pool_destroy(struct thread_pool *pool)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->queued);
+    pthread_mutex_unlock(&pool->lock);
+    for(i = 0; i < pool->nthreads; i++)
+    {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_cond_destroy(&pool->queued);
+    pthread_cond_destroy(&pool->completed);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->heap);
+    free(pool);
+}
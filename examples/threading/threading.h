@@ -1,5 +1,6 @@
 #include <stdbool.h>
 #include <pthread.h>
+#include <time.h>
 
 /**
  * This structure should be dynamically allocated and passed as
@@ -43,3 +44,62 @@ struct thread_data{
 * @return true if the thread could be started, false if a failure occurred.
 */
 bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex,int wait_to_obtain_ms, int wait_to_release_ms);
+
+/**
+ * A wait-obtain-hold-release job for a thread_pool, the pool counterpart of thread_data.
+ * The caller owns the memory, which must stay valid until thread_pool_wait returned for it.
+ */
+struct mutex_job{
+    /*wait params*/
+    int wait_to_obtain_ms;
+    int wait_to_release_ms;
+    /**
+     * Milliseconds to try for the mutex once the obtain wait is over, or -1 to wait as
+     * long as it takes
+     */
+    int obtain_timeout_ms;
+    /*mutex param*/
+    pthread_mutex_t *mutex;
+    /**
+     * Set to true if the job completed with success, false if an error occurred or
+     * the mutex could not be obtained in time.
+     */
+    bool complete_success;
+
+    /* Owned by the pool */
+    struct timespec obtain_at;
+    unsigned long seq;
+    bool done;
+};
+
+struct thread_pool;
+
+/**
+* Creates a pool of @param nthreads worker threads for mutex_job jobs.
+* Jobs waiting to obtain their mutex are kept in a queue ordered by deadline and take no
+* worker until the deadline passes, so the number of pending jobs is limited only by memory,
+* not by the number of threads.  A worker is busy while a job tries for and holds its mutex.
+* @return the pool, or NULL if it could not be created
+*/
+struct thread_pool *thread_pool_create(unsigned int nthreads);
+
+/**
+* Queues @param job, which sleeps @param wait_to_obtain_ms milliseconds from now, then obtains
+* @param mutex, giving up after @param obtain_timeout_ms unless that is -1, then holds it for
+* @param wait_to_release_ms milliseconds, then releases it.
+* Like start_thread_obtaining_mutex this does not block for the job to complete.
+* @return true if the job was queued, false if a failure occurred.
+*/
+bool thread_pool_submit_obtaining_mutex(struct thread_pool *pool, struct mutex_job *job,
+        pthread_mutex_t *mutex, int wait_to_obtain_ms, int wait_to_release_ms, int obtain_timeout_ms);
+
+/**
+* Blocks until @param job, queued on @param pool, completed.
+* @return the complete_success of the job
+*/
+bool thread_pool_wait(struct thread_pool *pool, struct mutex_job *job);
+
+/**
+* Runs the jobs still queued on @param pool at their deadlines, then stops and frees the pool.
+*/
+void thread_pool_destroy(struct thread_pool *pool);
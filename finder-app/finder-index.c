@@ -0,0 +1,374 @@
+/**
+ * @file finder-index.c
+ * @brief Persistent cache of per file search data for finder, see finder-index.h
+ *
+ * The index file holds a header naming the indexed directory, followed by one record per
+ * file: the length of its path including the terminating NUL, the path, and the members of
+ * struct finder_index_entry after path.  It is a cache in the byte order and layout of the
+ * machine which wrote it, and is ignored whenever the header does not match.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "finder-index.h"
+
+#define FINDER_INDEX_RECORD_SIZE \
+    (sizeof(struct finder_index_entry) - offsetof(struct finder_index_entry, dev))
+
+struct finder_index_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t root_len;
+    uint64_t count;
+};
+
+struct finder_index
+{
+    char *file;
+    char *root;
+    /* Contents of the index file, entry paths point into it */
+    char *blob;
+    struct finder_index_entry *entries;
+    size_t count;
+    /* Open addressed table of entry numbers plus one, 0 for a free slot */
+    uint32_t *slots;
+    size_t mask;
+};
+
+static uint64_t hash_bytes(const char *str, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        hash = (hash ^ (uint8_t)str[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+uint64_t finder_index_query_hash(const char *str, bool regex)
+{
+    return hash_bytes(str, strlen(str)) ^ (regex ? 0x9e3779b97f4a7c15ULL : 0);
+}
+
+static void build_table(struct finder_index *index)
+{
+    size_t size = 16;
+    size_t i, slot;
+
+    while (size < index->count * 2)
+    {
+        size *= 2;
+    }
+    index->slots = calloc(size, sizeof(*index->slots));
+    if (!index->slots)
+    {
+        index->count = 0;
+        return;
+    }
+    index->mask = size - 1;
+    for (i = 0; i < index->count; i++)
+    {
+        slot = hash_bytes(index->entries[i].path, strlen(index->entries[i].path)) & index->mask;
+        while (index->slots[slot])
+        {
+            slot = (slot + 1) & index->mask;
+        }
+        index->slots[slot] = i + 1;
+    }
+}
+
+/**
+ * Parses @param blob of @param size bytes, the contents of an index of @param root
+ * @return false if the blob is not such an index
+ */
+static bool parse(struct finder_index *index, char *blob, size_t size, const char *root)
+{
+    struct finder_index_header hdr;
+    size_t pos = sizeof(hdr);
+    uint32_t path_len;
+    size_t i;
+
+    if (size < sizeof(hdr))
+    {
+        return false;
+    }
+    memcpy(&hdr, blob, sizeof(hdr));
+    if (hdr.magic != FINDER_INDEX_MAGIC || hdr.version != FINDER_INDEX_VERSION ||
+            hdr.record_size != FINDER_INDEX_RECORD_SIZE || hdr.root_len != strlen(root) ||
+            size - pos < hdr.root_len || memcmp(blob + pos, root, hdr.root_len) != 0 ||
+            hdr.count > size / FINDER_INDEX_RECORD_SIZE)
+    {
+        return false;
+    }
+    pos += hdr.root_len;
+    index->entries = calloc(hdr.count ? hdr.count : 1, sizeof(*index->entries));
+    if (!index->entries)
+    {
+        return false;
+    }
+    for (i = 0; i < hdr.count; i++)
+    {
+        if (size - pos < sizeof(path_len))
+        {
+            return false;
+        }
+        memcpy(&path_len, blob + pos, sizeof(path_len));
+        pos += sizeof(path_len);
+        if (path_len == 0 || size - pos < path_len + FINDER_INDEX_RECORD_SIZE ||
+                blob[pos + path_len - 1] != '\0')
+        {
+            return false;
+        }
+        index->entries[i].path = blob + pos;
+        pos += path_len;
+        memcpy(&index->entries[i].dev, blob + pos, FINDER_INDEX_RECORD_SIZE);
+        pos += FINDER_INDEX_RECORD_SIZE;
+    }
+    index->count = hdr.count;
+    return true;
+}
+
+/**
+ * @return the index of directory @param root stored in @param file.  The index is empty if the
+ *      file is missing, damaged or belongs to another directory.  NULL if out of memory.
+ */
+struct finder_index *finder_index_load(const char *file, const char *root)
+{
+    struct finder_index *index = calloc(1, sizeof(*index));
+    FILE *fp;
+    long size;
+
+    if (!index)
+    {
+        return NULL;
+    }
+    index->file = strdup(file);
+    index->root = strdup(root);
+    if (!index->file || !index->root)
+    {
+        finder_index_free(index);
+        return NULL;
+    }
+    fp = fopen(file, "rb");
+    if (fp)
+    {
+        if (fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) > 0 && fseek(fp, 0, SEEK_SET) == 0 &&
+                (index->blob = malloc(size)) != NULL &&
+                fread(index->blob, 1, size, fp) == (size_t)size &&
+                !parse(index, index->blob, size, root))
+        {
+            index->count = 0;
+        }
+        fclose(fp);
+    }
+    build_table(index);
+    return index;
+}
+
+/**
+ * @return the entry for @param path, provided the file described by @param st is unchanged
+ *      since it was indexed, or NULL
+ */
+const struct finder_index_entry *finder_index_lookup(const struct finder_index *index,
+        const char *path, const struct stat *st)
+{
+    struct finder_index_entry key;
+    const struct finder_index_entry *entry;
+    size_t slot;
+
+    if (index->count == 0)
+    {
+        return NULL;
+    }
+    finder_index_set_stat(&key, st);
+    slot = hash_bytes(path, strlen(path)) & index->mask;
+    for (; index->slots[slot]; slot = (slot + 1) & index->mask)
+    {
+        entry = &index->entries[index->slots[slot] - 1];
+        if (strcmp(entry->path, path) != 0)
+        {
+            continue;
+        }
+        if (entry->dev != key.dev || entry->ino != key.ino || entry->size != key.size ||
+                entry->mtime_ns != key.mtime_ns || entry->ctime_ns != key.ctime_ns)
+        {
+            return NULL;
+        }
+        return entry;
+    }
+    return NULL;
+}
+
+/**
+ * Replaces the index file with @param count entries, written to a temporary file first so
+ * concurrent searches see either the old or the new index
+ * @return false if the file could not be written
+ */
+bool finder_index_save(const struct finder_index *index, struct finder_index_entry *const *entries,
+        size_t count)
+{
+    struct finder_index_header hdr = {
+        .magic = FINDER_INDEX_MAGIC,
+        .version = FINDER_INDEX_VERSION,
+        .record_size = FINDER_INDEX_RECORD_SIZE,
+        .root_len = strlen(index->root),
+        .count = count,
+    };
+    char tmp[4096];
+    uint32_t path_len;
+    bool ok;
+    size_t i;
+    FILE *fp;
+
+    if ((size_t)snprintf(tmp, sizeof(tmp), "%s.%ld", index->file, (long)getpid()) >= sizeof(tmp))
+    {
+        return false;
+    }
+    fp = fopen(tmp, "wb");
+    if (!fp)
+    {
+        return false;
+    }
+    ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 && fwrite(index->root, 1, hdr.root_len, fp) == hdr.root_len;
+    for (i = 0; ok && i < count; i++)
+    {
+        path_len = strlen(entries[i]->path) + 1;
+        ok = fwrite(&path_len, sizeof(path_len), 1, fp) == 1 &&
+                fwrite(entries[i]->path, 1, path_len, fp) == path_len &&
+                fwrite(&entries[i]->dev, FINDER_INDEX_RECORD_SIZE, 1, fp) == 1;
+    }
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok || rename(tmp, index->file) != 0)
+    {
+        unlink(tmp);
+        return false;
+    }
+    return true;
+}
+
+void finder_index_free(struct finder_index *index)
+{
+    if (index)
+    {
+        free(index->file);
+        free(index->root);
+        free(index->blob);
+        free(index->entries);
+        free(index->slots);
+        free(index);
+    }
+}
+
+void finder_index_set_stat(struct finder_index_entry *entry, const struct stat *st)
+{
+    entry->dev = st->st_dev;
+    entry->ino = st->st_ino;
+    entry->size = st->st_size;
+    entry->mtime_ns = st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+    entry->ctime_ns = st->st_ctim.tv_sec * 1000000000LL + st->st_ctim.tv_nsec;
+}
+
+/**
+ * @return true if the file described by @param st changed too recently for its times to tell
+ *      whether it changes again, see FINDER_INDEX_RACY_NS
+ */
+bool finder_index_is_racy(const struct stat *st)
+{
+    struct finder_index_entry key;
+    struct timespec now;
+    int64_t now_ns;
+
+    finder_index_set_stat(&key, st);
+    clock_gettime(CLOCK_REALTIME, &now);
+    now_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+    return now_ns - key.mtime_ns < FINDER_INDEX_RACY_NS || now_ns - key.ctime_ns < FINDER_INDEX_RACY_NS;
+}
+
+static inline unsigned int trigram_bit(const char *p)
+{
+    uint32_t trigram = (uint8_t)p[0] << 16 | (uint8_t)p[1] << 8 | (uint8_t)p[2];
+
+    return (trigram * 0x9e3779b1U) >> (32 - 11);
+}
+
+void finder_index_bloom_add(struct finder_index_entry *entry, const char *data, size_t size)
+{
+    unsigned int bit;
+    size_t i;
+
+    _Static_assert(FINDER_INDEX_BLOOM_BITS == 1 << 11, "trigram_bit() yields 11 bits");
+    for (i = 0; i + 3 <= size; i++)
+    {
+        bit = trigram_bit(data + i);
+        entry->bloom[bit / 8] |= 1 << (bit % 8);
+    }
+}
+
+/**
+ * @return false if no line of the file of @param entry contains the @param len bytes at @param str
+ */
+bool finder_index_bloom_may_contain(const struct finder_index_entry *entry, const char *str, size_t len)
+{
+    unsigned int bit;
+    size_t i;
+
+    for (i = 0; i + 3 <= len; i++)
+    {
+        bit = trigram_bit(str + i);
+        if (!(entry->bloom[bit / 8] & (1 << (bit % 8))))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+const struct finder_index_result *finder_index_find_result(const struct finder_index_entry *entry,
+        uint64_t query)
+{
+    uint32_t i;
+
+    for (i = 0; i < entry->nresults; i++)
+    {
+        if (entry->result[i].query == query)
+        {
+            return &entry->result[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Remembers @param lines matching lines for @param query, forgetting the least recent query if
+ * all FINDER_INDEX_RESULTS are taken
+ */
+void finder_index_add_result(struct finder_index_entry *entry, uint64_t query, uint64_t lines)
+{
+    uint32_t i;
+
+    for (i = 0; i < entry->nresults && entry->result[i].query != query; i++)
+    {
+    }
+    if (i == entry->nresults && entry->nresults < FINDER_INDEX_RESULTS)
+    {
+        entry->nresults++;
+    }
+    if (i == FINDER_INDEX_RESULTS)
+    {
+        i--;
+    }
+    memmove(&entry->result[1], &entry->result[0], i * sizeof(entry->result[0]));
+    entry->result[0].query = query;
+    entry->result[0].lines = lines;
+}
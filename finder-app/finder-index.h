@@ -0,0 +1,88 @@
+/**
+ * @file finder-index.h
+ * @brief Persistent cache of per file search data for finder
+ *
+ * With FINDER_INDEX set to a file name, finder remembers for every file below the searched
+ * directory its identity (device, inode, size, modification and change times), its number of
+ * lines, a bloom filter of the three byte sequences it contains and the matching line counts
+ * of its last few search strings.  A later search skips files whose identity is unchanged
+ * and which either answered the same search string before or cannot contain it according to
+ * the bloom filter.  Only the files seen by the latest search are written back, so removed
+ * files drop out.
+ *
+ * Timestamps only move when the clock ticks, so a file rewritten twice within one tick of the
+ * filesystem can keep its size and times.  Files changed less than FINDER_INDEX_RACY_NS before
+ * they were searched are therefore never cached.
+ */
+
+#ifndef FINDER_INDEX_H
+#define FINDER_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#define FINDER_INDEX_MAGIC 0x58444e46 /* "FNDX" */
+#define FINDER_INDEX_VERSION 1
+/* Search strings remembered per file, most recent first */
+#define FINDER_INDEX_RESULTS 4
+/* Size of the trigram bloom filter of each file */
+#define FINDER_INDEX_BLOOM_BITS 2048
+#define FINDER_INDEX_RACY_NS (2 * 1000000000LL)
+
+/* The file contains NUL bytes and never has matching lines */
+#define FINDER_INDEX_BINARY 1
+
+struct finder_index_result
+{
+    uint64_t query;
+    uint64_t lines;
+};
+
+struct finder_index_entry
+{
+    /* Path relative to the indexed directory */
+    char *path;
+    uint64_t dev;
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    /* Total number of lines */
+    uint64_t lines;
+    uint32_t flags;
+    uint32_t nresults;
+    struct finder_index_result result[FINDER_INDEX_RESULTS];
+    uint8_t bloom[FINDER_INDEX_BLOOM_BITS / 8];
+};
+
+struct finder_index;
+
+extern struct finder_index *finder_index_load(const char *file, const char *root);
+
+extern const struct finder_index_entry *finder_index_lookup(const struct finder_index *index,
+        const char *path, const struct stat *st);
+
+extern bool finder_index_save(const struct finder_index *index,
+        struct finder_index_entry *const *entries, size_t count);
+
+extern void finder_index_free(struct finder_index *index);
+
+extern void finder_index_set_stat(struct finder_index_entry *entry, const struct stat *st);
+
+extern bool finder_index_is_racy(const struct stat *st);
+
+extern void finder_index_bloom_add(struct finder_index_entry *entry, const char *data, size_t size);
+
+extern bool finder_index_bloom_may_contain(const struct finder_index_entry *entry,
+        const char *str, size_t len);
+
+extern const struct finder_index_result *finder_index_find_result(
+        const struct finder_index_entry *entry, uint64_t query);
+
+extern void finder_index_add_result(struct finder_index_entry *entry, uint64_t query, uint64_t lines);
+
+extern uint64_t finder_index_query_hash(const char *str, bool regex);
+
+#endif /* FINDER_INDEX_H */
@@ -56,10 +56,11 @@ fi
 #make clean
 #make
 
+# one writer process for all files, see writer.c
 for i in $( seq 1 $NUMFILES)
 do
-	writer "$WRITEDIR/${username}$i.txt" "$WRITESTR"
-done
+	printf '%s%s.txt\n' "${username}" "$i"
+done | writer --batch -C "$WRITEDIR" -s "$WRITESTR" -m -
 
 OUTPUTSTRING=$(finder.sh "$WRITEDIR" "$WRITESTR")
 echo ${OUTPUTSTRING}>${OUTDIR}
@@ -0,0 +1,611 @@
+/**
+ * @file finder.c
+ * @brief Native replacement for finder.sh
+ *
+ * Usage: finder <filesdir> <searchstr>
+ * Prints "The number of files are X and the number of matching lines are Y", where X is the
+ * number of regular files below filesdir, as counted by find -type f, and Y the number of lines
+ * in them matching searchstr, as counted by grep -r | wc -l.
+ *
+ * The tree is walked once by a pool of threads, one per online cpu unless FINDER_THREADS says
+ * otherwise.  Each thread keeps a deque of directories still to be read: it takes the newest
+ * one from its own deque and, once that is empty, steals the oldest one of another thread.
+ * Files are searched by the thread that finds them, through a read only mapping.
+ *
+ * With FINDER_INDEX set to a file name, per file results are cached there and files unchanged
+ * since an earlier search are not read again, see finder-index.h.
+ *
+ * searchstr is a basic regular expression, as for grep.  Without any of the characters which
+ * are special in one it is a plain string, found with a 16 byte wide compare of its first and
+ * last characters; otherwise every line is matched with regexec.  Like grep 3.5 and later,
+ * files containing NUL bytes are binary and contribute no matching lines.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <regex.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "finder-index.h"
+
+#define FINDER_MAX_THREADS 256
+
+struct worker
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    /* Directories to read, [head, tail) of dirs; the owner uses tail, thieves head */
+    char **dirs;
+    size_t head;
+    size_t tail;
+    size_t cap;
+    uint64_t files;
+    uint64_t lines;
+    /* NUL terminated copy of the current line for regexec */
+    char *line;
+    size_t line_cap;
+    /* Entries for the next version of the index */
+    struct finder_index_entry **entries;
+    size_t nentries;
+    size_t entries_cap;
+};
+
+static struct worker *workers;
+static unsigned int nworkers;
+/* Directories queued or being read, the walk is over when this drops to 0 */
+static atomic_size_t pending;
+
+static const char *searchstr;
+static size_t searchlen;
+static bool use_regex;
+static regex_t regex;
+
+static struct finder_index *index_cache;
+static uint64_t query_hash;
+static size_t root_len;
+
+static void push_dir(struct worker *w, char *path)
+{
+    char **dirs;
+
+    atomic_fetch_add(&pending, 1);
+    pthread_mutex_lock(&w->lock);
+    if (w->tail == w->cap)
+    {
+        // compact before growing, thieves leave free room at the front
+        if (w->head > 0)
+        {
+            memmove(w->dirs, w->dirs + w->head, (w->tail - w->head) * sizeof(*w->dirs));
+            w->tail -= w->head;
+            w->head = 0;
+        }
+        if (w->tail == w->cap)
+        {
+            dirs = realloc(w->dirs, (w->cap ? w->cap * 2 : 64) * sizeof(*w->dirs));
+            if (!dirs)
+            {
+                pthread_mutex_unlock(&w->lock);
+                perror("finder");
+                exit(1);
+            }
+            w->dirs = dirs;
+            w->cap = w->cap ? w->cap * 2 : 64;
+        }
+    }
+    w->dirs[w->tail++] = path;
+    pthread_mutex_unlock(&w->lock);
+}
+
+/**
+ * @return the newest directory of @param victim, or its oldest one when @param steal is set
+ */
+static char *take_dir(struct worker *victim, bool steal)
+{
+    char *path = NULL;
+
+    pthread_mutex_lock(&victim->lock);
+    if (victim->head < victim->tail)
+    {
+        path = steal ? victim->dirs[victim->head++] : victim->dirs[--victim->tail];
+    }
+    pthread_mutex_unlock(&victim->lock);
+    return path;
+}
+
+typedef uint8_t finder_u8x16 __attribute__((vector_size(16)));
+
+/**
+ * @return the first occurrence of searchstr in the @param len bytes at @param hay, or NULL
+ */
+static const char *find_literal(const char *hay, size_t len)
+{
+    const finder_u8x16 first = (finder_u8x16){ 0 } + (uint8_t)searchstr[0];
+    const finder_u8x16 last = (finder_u8x16){ 0 } + (uint8_t)searchstr[searchlen - 1];
+    finder_u8x16 a, b, hits;
+    uint64_t any[2];
+    size_t i = 0;
+    unsigned int k;
+
+    if (searchlen == 1)
+    {
+        return memchr(hay, searchstr[0], len);
+    }
+    // compare 16 candidate positions at once on both ends of the string, and only check the
+    // middle where both ends matched
+    for (; i + searchlen - 1 + sizeof(a) <= len; i += sizeof(a))
+    {
+        memcpy(&a, hay + i, sizeof(a));
+        memcpy(&b, hay + i + searchlen - 1, sizeof(b));
+        hits = (finder_u8x16)((a == first) & (b == last));
+        memcpy(any, &hits, sizeof(any));
+        if (!(any[0] | any[1]))
+        {
+            continue;
+        }
+        for (k = 0; k < sizeof(a); k++)
+        {
+            if (hits[k] && memcmp(hay + i + k + 1, searchstr + 1, searchlen - 2) == 0)
+            {
+                return hay + i + k;
+            }
+        }
+    }
+    return memmem(hay + i, len - i, searchstr, searchlen);
+}
+
+static uint64_t count_literal(const char *data, size_t size)
+{
+    const char *end = data + size;
+    const char *match;
+    uint64_t lines = 0;
+
+    while ((match = find_literal(data, end - data)) != NULL)
+    {
+        lines++;
+        data = memchr(match, '\n', end - match);
+        if (!data)
+        {
+            break;
+        }
+        data++;
+    }
+    return lines;
+}
+
+static uint64_t count_regex(struct worker *w, const char *data, size_t size)
+{
+    const char *end = data + size;
+    const char *newline;
+    uint64_t lines = 0;
+    size_t len;
+    char *line;
+
+    while (data < end)
+    {
+        newline = memchr(data, '\n', end - data);
+        len = (newline ? newline : end) - data;
+        if (len + 1 > w->line_cap)
+        {
+            line = realloc(w->line, len + 1);
+            if (!line)
+            {
+                perror("finder");
+                exit(1);
+            }
+            w->line = line;
+            w->line_cap = len + 1;
+        }
+        memcpy(w->line, data, len);
+        w->line[len] = '\0';
+        if (regexec(&regex, w->line, 0, NULL, 0) == 0)
+        {
+            lines++;
+        }
+        data += len + 1;
+    }
+    return lines;
+}
+
+static void *xmalloc(size_t size)
+{
+    void *ptr = malloc(size);
+
+    if (!ptr)
+    {
+        perror("finder");
+        exit(1);
+    }
+    return ptr;
+}
+
+/**
+ * Adds @param entry with the result of the current search to the entries of @param w
+ */
+static void keep_entry(struct worker *w, struct finder_index_entry *entry, uint64_t lines)
+{
+    struct finder_index_entry **entries;
+
+    finder_index_add_result(entry, query_hash, lines);
+    if (w->nentries == w->entries_cap)
+    {
+        w->entries_cap = w->entries_cap ? w->entries_cap * 2 : 64;
+        entries = realloc(w->entries, w->entries_cap * sizeof(*entries));
+        if (!entries)
+        {
+            perror("finder");
+            exit(1);
+        }
+        w->entries = entries;
+    }
+    w->entries[w->nentries++] = entry;
+}
+
+/**
+ * @return the path of @param name in @param dirpath relative to the searched directory
+ */
+static char *index_path(const char *dirpath, const char *name)
+{
+    const char *rel = dirpath + root_len;
+    char *path;
+
+    while (*rel == '/')
+    {
+        rel++;
+    }
+    path = xmalloc(strlen(rel) + strlen(name) + 2);
+    sprintf(path, "%s%s%s", rel, *rel ? "/" : "", name);
+    return path;
+}
+
+/**
+ * @return the cached number of matching lines of an unchanged file, or -1 if it must be read
+ */
+static int64_t cached_lines(const struct finder_index_entry *cached)
+{
+    const struct finder_index_result *result;
+
+    if (!cached)
+    {
+        return -1;
+    }
+    result = finder_index_find_result(cached, query_hash);
+    if (result)
+    {
+        return result->lines;
+    }
+    if ((cached->flags & FINDER_INDEX_BINARY) ||
+            (!use_regex && !finder_index_bloom_may_contain(cached, searchstr, searchlen)))
+    {
+        return 0;
+    }
+    return -1;
+}
+
+static void search_file(struct worker *w, int dirfd, const char *name, const char *dirpath)
+{
+    const struct finder_index_entry *cached = NULL;
+    struct finder_index_entry *entry;
+    char *path = NULL;
+    const char *newline;
+    const char *end;
+    struct stat st;
+    int64_t lines;
+    bool binary;
+    char *data;
+    int fd;
+
+    if (index_cache)
+    {
+        if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        {
+            fprintf(stderr, "finder: %s/%s: %s\n", dirpath, name, strerror(errno));
+            return;
+        }
+        path = index_path(dirpath, name);
+        cached = finder_index_lookup(index_cache, path, &st);
+        lines = cached_lines(cached);
+        if (lines >= 0)
+        {
+            entry = xmalloc(sizeof(*entry));
+            *entry = *cached;
+            entry->path = path;
+            keep_entry(w, entry, lines);
+            w->lines += lines;
+            return;
+        }
+    }
+
+    fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        fprintf(stderr, "finder: %s/%s: %s\n", dirpath, name, strerror(errno));
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        free(path);
+        return;
+    }
+    data = NULL;
+    if (st.st_size > 0)
+    {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            fprintf(stderr, "finder: %s/%s: %s\n", dirpath, name, strerror(errno));
+            close(fd);
+            free(path);
+            return;
+        }
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    lines = 0;
+    binary = false;
+    if (data)
+    {
+        if (use_regex)
+        {
+            lines = count_regex(w, data, st.st_size);
+        }
+        else
+        {
+            lines = count_literal(data, st.st_size);
+        }
+        if ((lines || path) && memchr(data, '\0', st.st_size))
+        {
+            binary = true;
+            lines = 0;
+        }
+    }
+    w->lines += lines;
+
+    // files still changing are left out, a later change may not show in their times
+    if (path && !finder_index_is_racy(&st))
+    {
+        entry = xmalloc(sizeof(*entry));
+        memset(entry, 0, sizeof(*entry));
+        finder_index_set_stat(entry, &st);
+        if (cached && cached->dev == entry->dev && cached->ino == entry->ino &&
+                cached->size == entry->size && cached->mtime_ns == entry->mtime_ns &&
+                cached->ctime_ns == entry->ctime_ns)
+        {
+            // unchanged, only this search was new
+            *entry = *cached;
+        }
+        else if (data)
+        {
+            end = data + st.st_size;
+            for (newline = data; (newline = memchr(newline, '\n', end - newline)) != NULL; newline++)
+            {
+                entry->lines++;
+            }
+            if (end[-1] != '\n')
+            {
+                entry->lines++;
+            }
+            entry->flags = binary ? FINDER_INDEX_BINARY : 0;
+            finder_index_bloom_add(entry, data, st.st_size);
+        }
+        entry->path = path;
+        keep_entry(w, entry, lines);
+        path = NULL;
+    }
+    free(path);
+    if (data)
+    {
+        munmap(data, st.st_size);
+    }
+}
+
+static void read_dir(struct worker *w, const char *path)
+{
+    struct dirent *entry;
+    struct stat st;
+    unsigned char type;
+    size_t pathlen;
+    char *child;
+    DIR *dir;
+
+    dir = opendir(path);
+    if (!dir)
+    {
+        fprintf(stderr, "finder: %s: %s\n", path, strerror(errno));
+        return;
+    }
+    pathlen = strlen(path);
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+        type = entry->d_type;
+        if (type == DT_UNKNOWN)
+        {
+            // symbolic links are neither followed nor counted, as with find -type f
+            if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+            {
+                continue;
+            }
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if (type == DT_REG)
+        {
+            w->files++;
+            search_file(w, dirfd(dir), entry->d_name, path);
+        }
+        else if (type == DT_DIR)
+        {
+            child = xmalloc(pathlen + strlen(entry->d_name) + 2);
+            sprintf(child, "%s/%s", path, entry->d_name);
+            push_dir(w, child);
+        }
+    }
+    closedir(dir);
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    unsigned int self = w - workers;
+    unsigned int i;
+    char *path;
+
+    for (;;)
+    {
+        path = take_dir(w, false);
+        for (i = 1; !path && i < nworkers; i++)
+        {
+            path = take_dir(&workers[(self + i) % nworkers], true);
+        }
+        if (path)
+        {
+            read_dir(w, path);
+            free(path);
+            atomic_fetch_sub(&pending, 1);
+        }
+        else if (atomic_load(&pending) == 0)
+        {
+            break;
+        }
+        else
+        {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static bool is_plain_string(const char *str)
+{
+    // the characters with a special meaning somewhere in a basic regular expression
+    return strpbrk(str, "\\.[*^$") == NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    struct finder_index_entry **entries = NULL;
+    uint64_t files = 0, lines = 0;
+    size_t nentries = 0;
+    struct stat st;
+    const char *env;
+    char *root;
+    char *real;
+    unsigned int i;
+    long ncpu;
+    int err;
+
+    if (argc < 3 || argv[1][0] == '\0' || argv[2][0] == '\0')
+    {
+        fprintf(stderr, "Error: Both directory path and search string must be provided.\n");
+        return 1;
+    }
+    if (stat(argv[1], &st) != 0 || !S_ISDIR(st.st_mode))
+    {
+        fprintf(stderr, "Error: Provided path '%s' is not a directory.\n", argv[1]);
+        return 1;
+    }
+
+    searchstr = argv[2];
+    searchlen = strlen(searchstr);
+    use_regex = !is_plain_string(searchstr);
+    if (use_regex && (err = regcomp(&regex, searchstr, REG_NOSUB)) != 0)
+    {
+        char msg[256];
+        regerror(err, &regex, msg, sizeof(msg));
+        fprintf(stderr, "Error: Invalid search string '%s': %s\n", searchstr, msg);
+        return 1;
+    }
+
+    env = getenv("FINDER_INDEX");
+    if (env && *env)
+    {
+        real = realpath(argv[1], NULL);
+        index_cache = real ? finder_index_load(env, real) : NULL;
+        free(real);
+        query_hash = finder_index_query_hash(searchstr, use_regex);
+        root_len = strlen(argv[1]);
+    }
+
+    env = getenv("FINDER_THREADS");
+    ncpu = env ? strtol(env, NULL, 0) : sysconf(_SC_NPROCESSORS_ONLN);
+    nworkers = ncpu < 1 ? 1 : ncpu > FINDER_MAX_THREADS ? FINDER_MAX_THREADS : ncpu;
+    workers = calloc(nworkers, sizeof(*workers));
+    root = strdup(argv[1]);
+    if (!workers || !root)
+    {
+        perror("finder");
+        return 1;
+    }
+    for (i = 0; i < nworkers; i++)
+    {
+        pthread_mutex_init(&workers[i].lock, NULL);
+    }
+    push_dir(&workers[0], root);
+    for (i = 0; i < nworkers; i++)
+    {
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0)
+        {
+            perror("finder");
+            return 1;
+        }
+    }
+    for (i = 0; i < nworkers; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        files += workers[i].files;
+        lines += workers[i].lines;
+        nentries += workers[i].nentries;
+        free(workers[i].dirs);
+        free(workers[i].line);
+        pthread_mutex_destroy(&workers[i].lock);
+    }
+    if (index_cache)
+    {
+        entries = malloc((nentries ? nentries : 1) * sizeof(*entries));
+        nentries = 0;
+        for (i = 0; entries && i < nworkers; i++)
+        {
+            memcpy(entries + nentries, workers[i].entries, workers[i].nentries * sizeof(*entries));
+            nentries += workers[i].nentries;
+        }
+        if (!entries || !finder_index_save(index_cache, entries, nentries))
+        {
+            fprintf(stderr, "finder: could not write index %s\n", getenv("FINDER_INDEX"));
+        }
+        for (i = 0; i < nentries; i++)
+        {
+            free(entries[i]->path);
+            free(entries[i]);
+        }
+        free(entries);
+        finder_index_free(index_cache);
+    }
+    for (i = 0; i < nworkers; i++)
+    {
+        free(workers[i].entries);
+    }
+    free(workers);
+    if (use_regex)
+    {
+        regfree(&regex);
+    }
+
+    printf("The number of files are %llu and the number of matching lines are %llu\n",
+            (unsigned long long)files, (unsigned long long)lines);
+    return 0;
+}
@@ -107,8 +107,10 @@ sudo mknod -m 666 dev/console c 5 1
 # TODO: Clean and build the writer utility
 cd ${FINDER_APP_DIR}
 make clean
-${CROSS_COMPILE}gcc -o writer writer.c
+${CROSS_COMPILE}gcc -pthread -o writer writer.c
 cp writer ${OUTDIR}/rootfs/home/
+${CROSS_COMPILE}gcc -O2 -pthread -o finder finder.c finder-index.c
+cp finder ${OUTDIR}/rootfs/home/
 
 # TODO: Copy the finder related scripts and executables to the /home directory
 # on the target rootfs
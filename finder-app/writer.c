@@ -1,50 +1,332 @@
+/**
+ * @file writer.c
+ * @brief Writes a string to a file, or strings to many files in one run
+ *
+ * Usage: writer <file> <string>
+ *        writer --batch [-C dir] [-j jobs] [-s string] -m manifest
+ *
+ * Any two arguments are the first form, whatever they start with.  The second form reads a manifest, or stdin for "-", with one "<file><TAB><string>" line per
+ * file, or with -s just "<file>" lines which all get that string.  Relative file names are
+ * opened below dir, the current directory by default, and each file is written with a single
+ * write call.  With -j the files are shared out to that many threads.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <syslog.h>
 #include <string.h>
+#include <unistd.h>
+
+#define WRITER_MAX_JOBS 64
 
-int main(int argc, char *argv[]) 
+struct batch_file
 {
-    FILE *fp;
-    char *filename;
-    char *text;
+    const char *name;
+    const char *text;
+    size_t len;
+};
 
-    // Check for correct argument count
-    if (argc != 3) 
+static struct batch_file *batch;
+static size_t batch_count;
+static atomic_size_t batch_next;
+static atomic_size_t batch_failed;
+static int batch_dirfd;
+
+static bool write_file(int dirfd, const char *name, const char *text, size_t len)
+{
+    ssize_t ret;
+    int fd;
+
+    fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0)
     {
-        fprintf(stderr, "Usage: %s <file> <string>\n", argv[0]);
-        return 1;
+        syslog(LOG_ERR, "Error opening file %s: %s", name, strerror(errno));
+        return false;
+    }
+    // regular files take the whole string at once, the loop only covers signals and quotas
+    while (len > 0)
+    {
+        ret = write(fd, text, len);
+        if (ret < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (ret <= 0)
+        {
+            syslog(LOG_ERR, "Error writing to file %s: %s", name, ret < 0 ? strerror(errno) : "short write");
+            close(fd);
+            return false;
+        }
+        text += ret;
+        len -= ret;
     }
+    if (close(fd) != 0)
+    {
+        syslog(LOG_ERR, "Error closing file %s: %s", name, strerror(errno));
+        return false;
+    }
+    return true;
+}
 
-    // Open syslog
-    openlog("writer", LOG_PID|LOG_CONS, LOG_USER);
-    filename = argv[1];
-    text = argv[2];
+static void *batch_worker(void *arg)
+{
+    size_t i;
 
-    // Log writing operation
-    syslog(LOG_DEBUG, "Writing %s to %s", text, filename);
+    (void)arg;
+    while ((i = atomic_fetch_add(&batch_next, 1)) < batch_count)
+    {
+        if (!write_file(batch_dirfd, batch[i].name, batch[i].text, batch[i].len))
+        {
+            atomic_fetch_add(&batch_failed, 1);
+        }
+    }
+    return NULL;
+}
 
-    // Try to open file for writing
-    fp = fopen(filename, "w");
-    if (fp == NULL) 
+/**
+ * @return the contents of @param path, or of stdin for "-", NUL terminated, or NULL on error
+ */
+static char *read_manifest(const char *path)
+{
+    size_t size = 0, cap = 65536;
+    char *buf = malloc(cap + 1);
+    char *grown;
+    ssize_t ret;
+    int fd;
+
+    fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || !buf)
     {
-        syslog(LOG_ERR, "Error opening file %s", filename);
-        closelog();
+        free(buf);
+        return NULL;
+    }
+    while ((ret = read(fd, buf + size, cap - size)) != 0)
+    {
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            free(buf);
+            buf = NULL;
+            break;
+        }
+        size += ret;
+        if (size == cap)
+        {
+            cap *= 2;
+            grown = realloc(buf, cap + 1);
+            if (!grown)
+            {
+                free(buf);
+                buf = NULL;
+                break;
+            }
+            buf = grown;
+        }
+    }
+    if (fd != STDIN_FILENO)
+    {
+        close(fd);
+    }
+    if (buf)
+    {
+        buf[size] = '\0';
+    }
+    return buf;
+}
+
+/**
+ * Splits @param manifest into batch, in place
+ * @return false if out of memory or a line has no string
+ */
+static bool parse_manifest(char *manifest, const char *text)
+{
+    size_t cap = 0;
+    struct batch_file *grown;
+    char *line, *next, *tab;
+
+    for (line = manifest; *line; line = next)
+    {
+        next = strchr(line, '\n');
+        if (next)
+        {
+            *next++ = '\0';
+        }
+        else
+        {
+            next = line + strlen(line);
+        }
+        if (*line == '\0')
+        {
+            continue;
+        }
+        if (batch_count == cap)
+        {
+            cap = cap ? cap * 2 : 1024;
+            grown = realloc(batch, cap * sizeof(*batch));
+            if (!grown)
+            {
+                syslog(LOG_ERR, "Out of memory reading the manifest");
+                return false;
+            }
+            batch = grown;
+        }
+        batch[batch_count].name = line;
+        if (text)
+        {
+            batch[batch_count].text = text;
+        }
+        else
+        {
+            tab = strchr(line, '\t');
+            if (!tab)
+            {
+                syslog(LOG_ERR, "Manifest line for %s has no string", line);
+                return false;
+            }
+            *tab = '\0';
+            batch[batch_count].text = tab + 1;
+        }
+        batch[batch_count].len = strlen(batch[batch_count].text);
+        batch_count++;
+    }
+    return true;
+}
+
+static int batch_usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s --batch [-C dir] [-j jobs] [-s string] -m manifest\n", prog);
+    return 1;
+}
+
+static int batch_main(int argc, char *argv[])
+{
+    const char *dir = ".", *manifest_path = NULL, *text = NULL;
+    pthread_t threads[WRITER_MAX_JOBS];
+    unsigned int jobs = 1, started, i;
+    char *manifest;
+    int opt;
+
+    // skip --batch
+    optind = 2;
+    while ((opt = getopt(argc, argv, "C:j:s:m:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'C':
+            dir = optarg;
+            break;
+        case 'j':
+            jobs = strtoul(optarg, NULL, 10);
+            if (jobs < 1)
+            {
+                jobs = 1;
+            }
+            if (jobs > WRITER_MAX_JOBS)
+            {
+                jobs = WRITER_MAX_JOBS;
+            }
+            break;
+        case 's':
+            text = optarg;
+            break;
+        case 'm':
+            manifest_path = optarg;
+            break;
+        default:
+            return batch_usage(argv[0]);
+        }
+    }
+    if (!manifest_path || optind != argc)
+    {
+        return batch_usage(argv[0]);
+    }
+
+    batch_dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (batch_dirfd < 0)
+    {
+        syslog(LOG_ERR, "Error opening directory %s: %s", dir, strerror(errno));
         return 1;
     }
+    manifest = read_manifest(manifest_path);
+    if (!manifest)
+    {
+        syslog(LOG_ERR, "Error reading manifest %s: %s", manifest_path, strerror(errno));
+        close(batch_dirfd);
+        return 1;
+    }
+    if (!parse_manifest(manifest, text))
+    {
+        free(batch);
+        free(manifest);
+        close(batch_dirfd);
+        return 1;
+    }
+
+    syslog(LOG_DEBUG, "Writing %zu files below %s", batch_count, dir);
+    if (jobs > batch_count)
+    {
+        jobs = batch_count ? batch_count : 1;
+    }
+    // the calling thread is one of the jobs
+    for (started = 0; started + 1 < jobs; started++)
+    {
+        if (pthread_create(&threads[started], NULL, batch_worker, NULL) != 0)
+        {
+            break;
+        }
+    }
+    batch_worker(NULL);
+    for (i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    free(batch);
+    free(manifest);
+    close(batch_dirfd);
+    return atomic_load(&batch_failed) ? 1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int ret;
 
-    // Write text to file
-    if (fprintf(fp, "%s", text) < 0) 
+    // The batch form needs --batch and at least -m manifest, so never has two arguments
+    if (argc != 3 && argc > 1 && strcmp(argv[1], "--batch") == 0)
     {
-        syslog(LOG_ERR, "Error writing to file %s", filename);
-        fclose(fp);
+        openlog("writer", LOG_PID|LOG_CONS, LOG_USER);
+        ret = batch_main(argc, argv);
         closelog();
+        return ret;
+    }
+
+    // Check for correct argument count
+    if (argc != 3)
+    {
+        fprintf(stderr, "Usage: %s <file> <string>\n", argv[0]);
+        fprintf(stderr, "       %s --batch [-C dir] [-j jobs] [-s string] -m manifest\n", argv[0]);
         return 1;
     }
 
-    // Close file and syslog
-    fclose(fp);
+    // Open syslog
+    openlog("writer", LOG_PID|LOG_CONS, LOG_USER);
+
+    // Log writing operation
+    syslog(LOG_DEBUG, "Writing %s to %s", argv[2], argv[1]);
+
+    ret = write_file(AT_FDCWD, argv[1], argv[2], strlen(argv[2])) ? 0 : 1;
+
+    // Close syslog
     closelog();
 
-    return 0;
+    return ret;
 }
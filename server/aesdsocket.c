@@ -110,7 +110,7 @@ void* connection_handler(void* socket_desc){
 
     char buffer[1024];
     ssize_t bytes_received;
-    int data_file_fd = open(DATA_FILE, O_WRONLY | O_CREAT | O_APPEND, 0666);
+    int data_file_fd = open(DATA_FILE, O_RDWR | O_CREAT | O_APPEND, 0666);
     if (data_file_fd == -1) {
         syslog(LOG_ERR, "open failed for %s", DATA_FILE);
         close(new_fd);
@@ -128,8 +128,7 @@ void* connection_handler(void* socket_desc){
                     pthread_exit(NULL);
                 }
 
-                // Read the content of the device and send it back over the socket
-                lseek(data_file_fd, 0, SEEK_SET);  // Reset file offset for the next read
+                // Read from the position the ioctl set on this fd and send it back over the socket
                 while ((bytes_received = read(data_file_fd, buffer, sizeof(buffer))) > 0) {
                     send(new_fd, buffer, bytes_received, 0);
                 }
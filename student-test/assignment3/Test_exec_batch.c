@@ -0,0 +1,146 @@
+/**
+ * @file Test_exec_batch.c
+ * @brief Tests of do_exec_batch from examples/systemcalls
+ *
+ * Runs batches of small shell commands and checks their exit status, captured stdout and
+ * stderr, the error of a program that does not exist, and that a command which closes its
+ * output and keeps running is waited for without waking the caller every millisecond.
+ * Run by ctest, see CMakeLists.txt.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "../../examples/systemcalls/systemcalls.h"
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, __func__, #cond); \
+            failures++; \
+            return; \
+        } \
+    } while (0)
+
+#define SH(script) { "/bin/sh", "-c", script, NULL }
+
+static unsigned int failures;
+
+static void release(struct exec_command *commands, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        exec_command_release(&commands[i]);
+    }
+}
+
+static void test_exit_status(void)
+{
+    char *const ok[] = SH("exit 0");
+    char *const three[] = SH("exit 3");
+    char *const killed[] = SH("kill -TERM $$");
+    struct exec_command commands[] = { { .argv = ok }, { .argv = three }, { .argv = killed } };
+
+    CHECK(!do_exec_batch(commands, 3, 0));
+    CHECK(commands[0].error == 0 && WIFEXITED(commands[0].status) && WEXITSTATUS(commands[0].status) == 0);
+    CHECK(commands[1].error == 0 && WIFEXITED(commands[1].status) && WEXITSTATUS(commands[1].status) == 3);
+    CHECK(commands[2].error == 0 && WIFSIGNALED(commands[2].status) && WTERMSIG(commands[2].status) == SIGTERM);
+    release(commands, 3);
+
+    CHECK(do_exec_batch(commands, 1, 1));
+    release(commands, 1);
+    CHECK(do_exec_batch(commands, 0, 0));
+}
+
+static void test_output(void)
+{
+    char *const both[] = SH("printf out; printf err >&2");
+    char *const none[] = SH("true");
+    // more than a pipe holds, so the command blocks unless the batch reads as it goes
+    char *const large[] = SH("head -c 1000000 /dev/zero | tr '\\0' x; printf e >&2");
+    struct exec_command commands[] = { { .argv = both }, { .argv = none }, { .argv = large } };
+    size_t i;
+
+    // one at a time and all at once
+    CHECK(do_exec_batch(commands, 3, 1));
+    CHECK(commands[0].out_len == 3 && strcmp(commands[0].out, "out") == 0);
+    CHECK(commands[0].err_len == 3 && strcmp(commands[0].err, "err") == 0);
+    CHECK(commands[1].out == NULL && commands[1].out_len == 0);
+    CHECK(commands[1].err == NULL && commands[1].err_len == 0);
+    CHECK(commands[2].out_len == 1000000 && commands[2].out[1000000] == '\0');
+    for (i = 0; i < commands[2].out_len; i++) {
+        CHECK(commands[2].out[i] == 'x');
+    }
+    CHECK(commands[2].err_len == 1 && strcmp(commands[2].err, "e") == 0);
+    release(commands, 3);
+
+    CHECK(do_exec_batch(commands, 3, 0));
+    CHECK(commands[0].out_len == 3 && commands[2].out_len == 1000000);
+    release(commands, 3);
+}
+
+static void test_missing_program(void)
+{
+    char *const missing[] = { "/nonexistent/program", NULL };
+    char *const ok[] = SH("printf ok");
+    struct exec_command commands[] = { { .argv = ok }, { .argv = missing }, { .argv = ok } };
+
+    // a command that fails to start does not stop the rest
+    CHECK(!do_exec_batch(commands, 3, 2));
+    CHECK(commands[1].error == ENOENT);
+    CHECK(commands[1].status == -1);
+    CHECK(commands[1].out == NULL && commands[1].err == NULL);
+    CHECK(commands[0].error == 0 && commands[0].status == 0 && strcmp(commands[0].out, "ok") == 0);
+    CHECK(commands[2].error == 0 && commands[2].status == 0 && strcmp(commands[2].out, "ok") == 0);
+    release(commands, 3);
+}
+
+static void test_closed_output(void)
+{
+    char *const closes[] = SH("printf early; exec >&- 2>&-; sleep 1; exit 5");
+    struct exec_command commands[] = { { .argv = closes } };
+    struct rusage before, after;
+    long wakeups;
+    int pidfd;
+
+    getrusage(RUSAGE_SELF, &before);
+    CHECK(!do_exec_batch(commands, 1, 0));
+    getrusage(RUSAGE_SELF, &after);
+    CHECK(WIFEXITED(commands[0].status) && WEXITSTATUS(commands[0].status) == 5);
+    CHECK(commands[0].out_len == 5 && strcmp(commands[0].out, "early") == 0);
+    CHECK(commands[0].elapsed_ns >= 900000000ULL);
+    release(commands, 1);
+
+    pidfd = syscall(SYS_pidfd_open, getpid(), 0);
+    if (pidfd < 0) {
+        printf("no pidfd_open on this kernel, not counting wakeups\n");
+        return;
+    }
+    close(pidfd);
+    // polling every millisecond for the second the command sleeps would be about 1000
+    wakeups = after.ru_nvcsw - before.ru_nvcsw;
+    CHECK(wakeups < 100);
+}
+
+int main(void)
+{
+    test_exit_status();
+    test_output();
+    test_missing_program();
+    test_closed_output();
+    if (failures) {
+        fprintf(stderr, "%u checks failed\n", failures);
+        return 1;
+    }
+    printf("all exec batch tests passed\n");
+    return 0;
+}
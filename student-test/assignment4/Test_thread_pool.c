@@ -0,0 +1,134 @@
+/**
+ * @file Test_thread_pool.c
+ * @brief Tests of the mutex_job thread_pool from examples/threading
+ *
+ * Checks that due jobs run in deadline order, not submission order, that a job giving up on
+ * its mutex after obtain_timeout_ms fails without waiting for the holder, and that
+ * thread_pool_destroy still runs the jobs queued on the pool.  Orders are observed from
+ * the done flags, with jobs holding their mutex long enough that the next one cannot have
+ * finished yet.  Run by ctest, see CMakeLists.txt.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../../examples/threading/threading.h"
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, __func__, #cond); \
+            failures++; \
+            return; \
+        } \
+    } while (0)
+
+#define NJOBS 5
+#define HOLD_MS 100
+
+static unsigned int failures;
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* done is set by a worker under the pool lock, this only peeks at it */
+static bool job_done(struct mutex_job *job)
+{
+    return __atomic_load_n(&job->done, __ATOMIC_ACQUIRE);
+}
+
+static void test_deadline_order(void)
+{
+    pthread_mutex_t blocker = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_t mutexes[NJOBS];
+    struct mutex_job busy, jobs[NJOBS];
+    struct thread_pool *pool = thread_pool_create(1);
+    int i;
+
+    CHECK(pool != NULL);
+    // the only worker is busy until every job below is due, then takes them by deadline
+    CHECK(thread_pool_submit_obtaining_mutex(pool, &busy, &blocker, 0, 3 * HOLD_MS, -1));
+    for (i = 0; i < NJOBS; i++) {
+        pthread_mutex_init(&mutexes[i], NULL);
+        // submitted latest deadline first
+        CHECK(thread_pool_submit_obtaining_mutex(pool, &jobs[i], &mutexes[i],
+                (NJOBS - i) * 10, HOLD_MS, -1));
+    }
+    CHECK(thread_pool_wait(pool, &busy));
+    for (i = NJOBS - 1; i >= 0; i--) {
+        CHECK(thread_pool_wait(pool, &jobs[i]));
+        // the next job by deadline is still holding its mutex
+        if (i > 0) {
+            CHECK(!job_done(&jobs[i - 1]));
+        }
+    }
+    thread_pool_destroy(pool);
+    for (i = 0; i < NJOBS; i++) {
+        pthread_mutex_destroy(&mutexes[i]);
+    }
+}
+
+static void test_obtain_timeout(void)
+{
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    struct mutex_job holder, impatient, patient;
+    struct thread_pool *pool = thread_pool_create(3);
+    uint64_t start;
+
+    CHECK(pool != NULL);
+    start = now_ms();
+    CHECK(thread_pool_submit_obtaining_mutex(pool, &holder, &mutex, 0, 3 * HOLD_MS, -1));
+    CHECK(thread_pool_submit_obtaining_mutex(pool, &impatient, &mutex, HOLD_MS / 2, 0, HOLD_MS / 2));
+    CHECK(thread_pool_submit_obtaining_mutex(pool, &patient, &mutex, HOLD_MS / 2, 0, -1));
+    CHECK(!thread_pool_wait(pool, &impatient));
+    CHECK(!impatient.complete_success);
+    CHECK(now_ms() - start >= HOLD_MS);
+    // it gave up on its own, not when the holder let go
+    CHECK(!job_done(&holder));
+    CHECK(thread_pool_wait(pool, &holder));
+    CHECK(thread_pool_wait(pool, &patient));
+    CHECK(now_ms() - start >= 3 * HOLD_MS);
+    thread_pool_destroy(pool);
+}
+
+static void test_destroy_runs_queued(void)
+{
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    struct mutex_job jobs[NJOBS];
+    struct thread_pool *pool = thread_pool_create(2);
+    uint64_t start;
+    int i;
+
+    CHECK(pool != NULL);
+    start = now_ms();
+    for (i = 0; i < NJOBS; i++) {
+        CHECK(thread_pool_submit_obtaining_mutex(pool, &jobs[i], &mutex, HOLD_MS + i * 10, 0, -1));
+    }
+    // none is due yet
+    thread_pool_destroy(pool);
+    CHECK(now_ms() - start >= HOLD_MS + (NJOBS - 1) * 10);
+    for (i = 0; i < NJOBS; i++) {
+        CHECK(jobs[i].done);
+        CHECK(jobs[i].complete_success);
+    }
+}
+
+int main(void)
+{
+    test_deadline_order();
+    test_obtain_timeout();
+    test_destroy_runs_queued();
+    if (failures) {
+        fprintf(stderr, "%u checks failed\n", failures);
+        return 1;
+    }
+    printf("all thread pool tests passed\n");
+    return 0;
+}
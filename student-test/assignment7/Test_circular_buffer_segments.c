@@ -0,0 +1,332 @@
+/**
+ * @file Test_circular_buffer_segments.c
+ * @brief Correctness tests of the aesd-char-driver circular buffer segment iterator and batch adds
+ *
+ * Every test feeds the buffer a sequence of entries and checks it against a model holding all
+ * entries ever added: the live ones are the last AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED.
+ * Reads through struct aesd_circular_buffer_iter are compared byte for byte with the model
+ * over every start offset, and each segment must lie within a single entry buffer or chain
+ * segment.  Built with AESD_BUFFER_CHAINS and run by ctest, see CMakeLists.txt.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+#define CAPACITY AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+#define MAX_ENTRIES 4096
+#define MAX_REGIONS (4 * MAX_ENTRIES)
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, __func__, #cond); \
+            failures++; \
+            return; \
+        } \
+    } while (0)
+
+struct model_entry {
+    /* What the buffer holds, a contiguous buffer or a tagged chain */
+    struct aesd_buffer_entry entry;
+    /* The same bytes in one piece */
+    const char *flat;
+};
+
+/* A contiguous piece of memory a segment may come from */
+struct region {
+    const char *start;
+    size_t size;
+};
+
+static unsigned int failures;
+static struct model_entry model[MAX_ENTRIES];
+static size_t nmodel;
+static struct region regions[MAX_REGIONS];
+static size_t nregions;
+static uint32_t rng_state = 2463534242U;
+
+static uint32_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static void reset_model(struct aesd_circular_buffer *buffer)
+{
+    size_t i;
+
+    for (i = 0; i < nmodel; i++) {
+        free((void *)model[i].flat);
+    }
+    for (i = 0; i < nregions; i++) {
+        free((void *)regions[i].start);
+    }
+    nmodel = 0;
+    nregions = 0;
+    aesd_circular_buffer_init(buffer);
+}
+
+static const char *region_alloc(size_t size)
+{
+    char *mem = malloc(size ? size : 1);
+
+    if (!mem || nregions == MAX_REGIONS) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    regions[nregions].start = mem;
+    regions[nregions++].size = size;
+    return mem;
+}
+
+/**
+ * @return a new model entry of @param size bytes, split in a chain of @param segment_size
+ *      byte segments unless that is 0, not yet added to the buffer
+ */
+static struct model_entry *make_entry(size_t size, size_t segment_size)
+{
+    struct model_entry *m = &model[nmodel++];
+    struct aesd_buffer_chain *chain;
+    char *flat = malloc(size ? size : 1);
+    size_t i, nr;
+
+    for (i = 0; i < size; i++) {
+        flat[i] = 'a' + (nmodel + i) % 26;
+    }
+    m->flat = flat;
+    m->entry.size = size;
+    if (!segment_size) {
+        m->entry.buffptr = memcpy((char *)region_alloc(size), flat, size);
+        return m;
+    }
+    nr = (size + segment_size - 1) / segment_size;
+    chain = (struct aesd_buffer_chain *)region_alloc(sizeof(*chain) + nr * sizeof(chain->segment[0]));
+    // the chain header is not data, keep segments from matching it
+    regions[nregions - 1].size = 0;
+    chain->segment_size = segment_size;
+    chain->nr_segments = nr;
+    for (i = 0; i < nr; i++) {
+        chain->segment[i] = memcpy((char *)region_alloc(segment_size), flat + i * segment_size,
+                i + 1 < nr ? segment_size : size - i * segment_size);
+    }
+    m->entry.buffptr = aesd_buffer_chain_ptr(chain);
+    return m;
+}
+
+static size_t model_first_live(void)
+{
+    return nmodel > CAPACITY ? nmodel - CAPACITY : 0;
+}
+
+static bool in_one_region(const char *data, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < nregions; i++) {
+        if (data >= regions[i].start && data + len <= regions[i].start + regions[i].size) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Checks the size, the entries and every byte range of @param buffer against the model
+ */
+static void check_buffer(struct aesd_circular_buffer *buffer)
+{
+    static char expected[1 << 16];
+    static char got[1 << 16];
+    static const size_t counts[] = { 1, 3, 7, SIZE_MAX };
+    struct aesd_circular_buffer_iter iter;
+    size_t total = 0, offset, count, got_len, i, c;
+    const char *data;
+    size_t len;
+
+    for (i = model_first_live(); i < nmodel; i++) {
+        memcpy(expected + total, model[i].flat, model[i].entry.size);
+        total += model[i].entry.size;
+    }
+    CHECK((size_t)buffer->total_size == total);
+    CHECK(aesd_circular_buffer_count(buffer) == nmodel - model_first_live());
+    for (i = model_first_live(); i < nmodel; i++) {
+        CHECK(aesd_circular_buffer_at(buffer, i - model_first_live())->buffptr == model[i].entry.buffptr);
+    }
+
+    for (offset = 0; offset <= total; offset++) {
+        for (c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+            count = counts[c];
+            CHECK(aesd_circular_buffer_iter_init(&iter, buffer, offset, count) == (offset < total));
+            got_len = 0;
+            while (aesd_circular_buffer_iter_next(&iter, &data, &len)) {
+                CHECK(len > 0);
+                CHECK(in_one_region(data, len));
+                CHECK(got_len + len <= total - offset);
+                memcpy(got + got_len, data, len);
+                got_len += len;
+            }
+            if (count > total - offset) {
+                count = total - offset;
+            }
+            CHECK(got_len == count);
+            CHECK(memcmp(got, expected + offset, count) == 0);
+        }
+    }
+}
+
+static void add_one(struct aesd_circular_buffer *buffer, struct model_entry *m)
+{
+    const char *evicted = aesd_circular_buffer_add_entry(buffer, &m->entry);
+
+    if (nmodel > CAPACITY) {
+        CHECK(evicted == model[nmodel - 1 - CAPACITY].entry.buffptr);
+    } else {
+        CHECK(evicted == NULL);
+    }
+}
+
+static void test_wraparound(void)
+{
+    struct aesd_circular_buffer buffer;
+    size_t i;
+
+    reset_model(&buffer);
+    // enough adds to wrap the slots and the 8 bit head counter several times
+    for (i = 0; i < 3 * 256 + CAPACITY / 2; i++) {
+        add_one(&buffer, make_entry(1 + rng() % 9, 0));
+        if (i % 37 == 0 || i > 3 * 256) {
+            check_buffer(&buffer);
+        }
+    }
+    reset_model(&buffer);
+}
+
+static void test_zero_size_entries(void)
+{
+    struct aesd_circular_buffer buffer;
+    size_t i;
+
+    reset_model(&buffer);
+    for (i = 0; i < 4 * CAPACITY; i++) {
+        add_one(&buffer, make_entry(i % 3 == 0 ? 0 : 1 + rng() % 5, 0));
+        check_buffer(&buffer);
+    }
+    // a buffer of nothing but empty entries has no data to iterate
+    for (i = 0; i < CAPACITY; i++) {
+        add_one(&buffer, make_entry(0, 0));
+    }
+    check_buffer(&buffer);
+    reset_model(&buffer);
+}
+
+/**
+ * Adds @param count new entries in one aesd_circular_buffer_add_entries call and checks what
+ * it evicted: the oldest live entries, then the start of the batch itself
+ */
+static void add_batch(struct aesd_circular_buffer *buffer, size_t count)
+{
+    struct aesd_buffer_entry batch[4 * CAPACITY];
+    const char *evicted[4 * CAPACITY];
+    size_t first = nmodel, before = model_first_live(), nevicted, i;
+
+    for (i = 0; i < count; i++) {
+        batch[i] = make_entry(rng() % 6, rng() % 3 == 0 ? 2 : 0)->entry;
+    }
+    nevicted = aesd_circular_buffer_add_entries(buffer, batch, count, evicted);
+    CHECK(nevicted == model_first_live() - before);
+    for (i = 0; i < nevicted; i++) {
+        CHECK(evicted[i] == model[before + i].entry.buffptr);
+    }
+    CHECK(nmodel == first + count);
+}
+
+static void test_add_entries(void)
+{
+    struct aesd_circular_buffer buffer;
+    size_t sizes[] = { 1, 3, CAPACITY - 4, CAPACITY, CAPACITY + 1, 2 * CAPACITY + 3, 4 * CAPACITY };
+    size_t i, s;
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        reset_model(&buffer);
+        // from empty, partly filled and full buffers
+        for (i = 0; i < 3; i++) {
+            add_batch(&buffer, sizes[s]);
+            check_buffer(&buffer);
+            add_one(&buffer, make_entry(4, 0));
+            check_buffer(&buffer);
+        }
+    }
+    reset_model(&buffer);
+}
+
+static void test_chain_segments(void)
+{
+    struct aesd_circular_buffer buffer;
+    const size_t segment_sizes[] = { 1, 4, 7, 16 };
+    size_t i, s;
+
+    for (s = 0; s < sizeof(segment_sizes) / sizeof(segment_sizes[0]); s++) {
+        reset_model(&buffer);
+        for (i = 0; i < 2 * CAPACITY; i++) {
+            // exact multiples of the segment size, and a short last segment
+            add_one(&buffer, make_entry(i % 2 ? 3 * segment_sizes[s] : 2 * segment_sizes[s] + 1 + i % 3,
+                    segment_sizes[s]));
+            add_one(&buffer, make_entry(i % 4, 0));
+            check_buffer(&buffer);
+        }
+    }
+    reset_model(&buffer);
+}
+
+static void test_vector_scan_matches_binary_search(void)
+{
+    struct aesd_circular_buffer buffer;
+    unsigned int scanned, searched, expected;
+    size_t i, k, offset, first, start;
+    bool have_scan;
+
+    reset_model(&buffer);
+    have_scan = aesd_circular_buffer_search_index(&buffer, 0, true, &scanned);
+    if (!have_scan) {
+        printf("vector scan not built for this target, checking the binary search only\n");
+    }
+    for (i = 0; i < 300; i++) {
+        add_one(&buffer, make_entry(rng() % 4, 0));
+        first = model_first_live();
+        for (offset = 0; offset < (size_t)buffer.total_size; offset++) {
+            // the model: the last live entry starting at or before offset
+            expected = 0;
+            for (start = 0, k = first; k < nmodel && start <= offset; start += model[k++].entry.size) {
+                expected = k - first;
+            }
+            CHECK(aesd_circular_buffer_search_index(&buffer, offset, false, &searched));
+            CHECK(searched == expected);
+            if (have_scan) {
+                CHECK(aesd_circular_buffer_search_index(&buffer, offset, true, &scanned));
+                CHECK(scanned == searched);
+            }
+        }
+    }
+    reset_model(&buffer);
+}
+
+int main(void)
+{
+    test_wraparound();
+    test_zero_size_entries();
+    test_add_entries();
+    test_chain_segments();
+    test_vector_scan_matches_binary_search();
+    if (failures) {
+        fprintf(stderr, "%u checks failed\n", failures);
+        return 1;
+    }
+    printf("all circular buffer segment tests passed\n");
+    return 0;
+}